@@ -0,0 +1,191 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include "common.h"
+#include "handler_stats.hpp"
+#include "buffer_pool.hpp"
+#include "function_traits.hpp"
+
+class connection;
+
+//the router callback which sends a result: topic, result, connection, request id, has_error.
+typedef std::function<void(const std::string&, std::string&&, std::shared_ptr<connection>, std::uint32_t, bool)> response_callback;
+
+//what a handler needs to answer its request later.
+struct call_context
+{
+	const response_callback* callback;
+	const std::string* name; //owned by the handler table which owner holds, or by a static table
+	std::shared_ptr<connection> conn;
+	std::uint32_t id;
+	handler_stats* stats; //nullptr if the response is not counted, e.g. the one of a call made for others
+	std::chrono::steady_clock::time_point start;
+	std::size_t bytes_in;
+	std::uint64_t trace; //the trace of a sampled request, 0 if it is not traced
+	std::shared_ptr<const void> owner; //the handler table of name and stats until the call is answered
+	std::shared_ptr<const void> callback_owner; //a callback which is not the router's, e.g. the one collecting a batch
+};
+
+inline std::uint64_t micros_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+//the response of a handler is sent through here, so it is counted in the stats of the handler.
+inline void send_response(const call_context& ctx, std::string&& result, bool has_error = false)
+{
+	if (ctx.stats != nullptr)
+		ctx.stats->on_response(ctx.bytes_in, result, micros_since(ctx.start));
+
+	(*ctx.callback)(*ctx.name, std::move(result), ctx.conn, ctx.id, has_error);
+}
+
+//the copies of a response share one answer: the first answer is sent and the later ones are dropped,
+//the last copy answers with an error when it goes away and none of them has answered.
+class async_response_base
+{
+public:
+	typedef void(*error_pack_type)(std::string&, result_code, const std::string&);
+
+	//answers with result_code::EXCEPTION and the message.
+	void error(const std::string& message) const
+	{
+		if (take_answer())
+			state_->send_error(message);
+	}
+
+	//true for the first caller only. the router takes the answer when the handler throws,
+	//so the exception is sent unless the handler has answered before.
+	bool take_answer() const
+	{
+		return state_ != nullptr && !state_->answered.exchange(true);
+	}
+
+protected:
+	async_response_base()
+	{
+	}
+
+	async_response_base(const call_context& ctx, error_pack_type error_pack) : state_(std::make_shared<state>(ctx, error_pack))
+	{
+	}
+
+	void send(std::string&& buf) const
+	{
+		send_response(state_->ctx, std::move(buf));
+	}
+
+private:
+	struct state
+	{
+		state(const call_context& c, error_pack_type e) : ctx(c), error_pack(e), answered(false)
+		{
+		}
+
+		~state()
+		{
+			if (answered.load())
+				return;
+
+			try
+			{
+				send_error("the handler didn't answer");
+			}
+			catch (...)
+			{
+			}
+		}
+
+		void send_error(const std::string& message)
+		{
+			std::string buf = string_pool::take();
+			error_pack(buf, result_code::EXCEPTION, message);
+			send_response(ctx, std::move(buf));
+		}
+
+		call_context ctx;
+		error_pack_type error_pack;
+		std::atomic<bool> answered;
+	};
+
+	std::shared_ptr<state> state_;
+};
+
+//a handler taking async_response<T> as its last parameter answers later: it returns at once and calls the
+//async_response once with the result when it is ready, from any thread. the connection goes on with its other calls meanwhile.
+template<typename T>
+class async_response : public async_response_base
+{
+public:
+	typedef T value_type;
+	typedef void(*pack_type)(std::string&, result_code, const T&);
+
+	async_response() : pack_(nullptr)
+	{
+	}
+
+	async_response(const call_context& ctx, pack_type pack, error_pack_type error_pack) : async_response_base(ctx, error_pack), pack_(pack)
+	{
+	}
+
+	void operator()(const T& r) const
+	{
+		if (!take_answer())
+			return;
+
+		std::string buf = string_pool::take();
+		pack_(buf, result_code::OK, r);
+		send(std::move(buf));
+	}
+
+private:
+	pack_type pack_;
+};
+
+//no result, the response carries 0 like the one of a void handler.
+template<>
+class async_response<void> : public async_response_base
+{
+public:
+	typedef int value_type;
+	typedef void(*pack_type)(std::string&, result_code, const int&);
+
+	async_response() : pack_(nullptr)
+	{
+	}
+
+	async_response(const call_context& ctx, pack_type pack, error_pack_type error_pack) : async_response_base(ctx, error_pack), pack_(pack)
+	{
+	}
+
+	void operator()() const
+	{
+		if (!take_answer())
+			return;
+
+		std::string buf = string_pool::take();
+		pack_(buf, result_code::OK, 0);
+		send(std::move(buf));
+	}
+
+private:
+	pack_type pack_;
+};
+
+template<typename T>
+struct is_async_response : std::false_type {};
+
+template<typename T>
+struct is_async_response<async_response<T>> : std::true_type {};
+
+//true if the last parameter of the handler is an async_response.
+template<typename Function, bool = (function_traits<Function>::arity > 0)>
+struct takes_async_response : std::false_type {};
+
+template<typename Function>
+struct takes_async_response<Function, true> : is_async_response<typename std::decay<
+	typename function_traits<Function>::template args<function_traits<Function>::arity - 1>::type>::type> {};
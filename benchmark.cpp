@@ -0,0 +1,278 @@
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <kapok/Kapok.hpp>
+#include "router.hpp"
+#include "connection.hpp"
+#include "client_proxy/client_proxy.hpp"
+
+//microbenchmarks of the hot paths of a call: parsing the request, dispatching it to the handler, packing the result
+//and making a request on the client. every case is repeated until it runs for at least 0.2s and reports the time
+//and the heap allocations of one operation, the allocations are counted by the operator new below.
+//build it with optimizations, e.g. cmake -DCMAKE_BUILD_TYPE=Release.
+
+static std::atomic<std::size_t> g_allocations(0);
+
+void* operator new(std::size_t size)
+{
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	void* p = std::malloc(size == 0 ? 1 : size);
+	if (p == nullptr)
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+//the results are added to it, so the compiler can't drop the work.
+static volatile std::size_t g_sink = 0;
+
+template<typename F>
+void bench(const std::string& name, F&& f)
+{
+	typedef std::chrono::steady_clock clock_type;
+	f();
+	for (std::size_t n = 1;; n *= 2)
+	{
+		const std::size_t allocations = g_allocations.load(std::memory_order_relaxed);
+		const clock_type::time_point start = clock_type::now();
+		for (std::size_t i = 0; i < n; i++)
+			f();
+
+		const double ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count());
+		if (ns >= 2e8 || n >= (std::size_t(1) << 30))
+		{
+			std::printf("%-36s %12.1f ns/op %10.2f allocs/op\n", name.c_str(), ns / n, static_cast<double>(g_allocations.load(std::memory_order_relaxed) - allocations) / n);
+			return;
+		}
+	}
+}
+
+//{"name":[1,2,...]} with count integers.
+static std::string int_request(const char* name, std::size_t count)
+{
+	std::string s = std::string("{\"") + name + "\":[";
+	for (std::size_t i = 0; i < count; i++)
+		s += (i == 0 ? "" : ",") + std::to_string(i + 1);
+
+	return s + "]}";
+}
+
+//{"name":["xx..."]} with a string of size bytes.
+static std::string string_request(const char* name, std::size_t size)
+{
+	return std::string("{\"") + name + "\":[\"" + std::string(size, 'x') + "\"]}";
+}
+
+struct bench_point
+{
+	int x;
+	double y;
+	std::string tag;
+	std::vector<int> values;
+	META(x, y, tag, values);
+};
+
+int add(int a, int b)
+{
+	return a + b;
+}
+
+int sum16(int a0, int a1, int a2, int a3, int a4, int a5, int a6, int a7, int a8, int a9, int a10, int a11, int a12, int a13, int a14, int a15)
+{
+	return a0 + a1 + a2 + a3 + a4 + a5 + a6 + a7 + a8 + a9 + a10 + a11 + a12 + a13 + a14 + a15;
+}
+
+std::size_t length(const std::string& s)
+{
+	return s.size();
+}
+
+std::string echo(const std::string& s)
+{
+	return s;
+}
+
+bench_point point(int x)
+{
+	return{ x, 0.5, "point", { 1, 2, 3, 4 } };
+}
+
+void bench_parser()
+{
+	for (std::size_t count : { 1, 4, 16 })
+	{
+		const std::string request = int_request("f", count);
+		bench("parse ints/" + std::to_string(count), [&]
+		{
+			token_parser parser;
+			parser.parse(request.data(), request.size());
+			g_sink += parser.param_size();
+		});
+
+		bench("parse+get ints/" + std::to_string(count), [&]
+		{
+			token_parser parser;
+			parser.parse(request.data(), request.size());
+			g_sink += parser.read_name().size();
+			while (!parser.empty())
+				g_sink += parser.get<int>();
+		});
+	}
+
+	for (std::size_t size : { 16, 1024, 65536 })
+	{
+		const std::string request = string_request("f", size);
+		bench("parse+get string/" + std::to_string(size), [&]
+		{
+			token_parser parser;
+			parser.parse(request.data(), request.size());
+			g_sink += parser.read_name().size();
+			g_sink += parser.get<std::string>().size();
+		});
+	}
+}
+
+void bench_router(boost::asio::io_service& io_service, buffer_pool& pool)
+{
+	router& r = router::get();
+	r.set_callback([](const std::string&, std::string&& result, std::shared_ptr<connection>, std::uint32_t, bool)
+	{
+		g_sink += result.size();
+		string_pool::give_back(std::move(result));
+	});
+
+	r.register_handler("add", &add);
+	r.register_handler("sum16", &sum16);
+	r.register_handler("length", &length);
+	r.register_handler("echo", &echo);
+	r.register_handler("point", &point);
+	r.register_handlers(RPC_HANDLER("static_add", &add));
+
+	//a few more names, so the lookup is not in a table of a handful.
+	for (int i = 0; i < 64; i++)
+		r.register_handler("handler" + std::to_string(i), &add);
+
+	auto conn = std::make_shared<connection>(io_service, pool, 0);
+	auto route = [&](const std::string& name, const std::string& request)
+	{
+		bench("route " + name, [&]
+		{
+			r.route(request.data(), request.size(), 1, conn);
+		});
+	};
+
+	route("add", int_request("add", 2));
+	route("static add", int_request("static_add", 2));
+	route("add, 64 handlers", int_request("handler63", 2));
+	route("unknown", int_request("nothing", 2));
+	route("ints/16", int_request("sum16", 16));
+	route("point", int_request("point", 1));
+	for (std::size_t size : { 16, 1024, 65536 })
+	{
+		route("length string/" + std::to_string(size), string_request("length", size));
+		route("echo string/" + std::to_string(size), string_request("echo", size));
+	}
+}
+
+void bench_get_json()
+{
+	std::string buf;
+	bench("get_json int", [&]
+	{
+		buf.clear();
+		get_json(buf, OK, 12345);
+		g_sink += buf.size();
+	});
+
+	bench("get_json double", [&]
+	{
+		buf.clear();
+		get_json(buf, OK, 3.14159);
+		g_sink += buf.size();
+	});
+
+	for (std::size_t size : { 16, 1024, 65536 })
+	{
+		const std::string s(size, 'x');
+		bench("get_json string/" + std::to_string(size), [&]
+		{
+			buf.clear();
+			get_json(buf, OK, s);
+			g_sink += buf.size();
+		});
+	}
+
+	const bench_point p = point(7);
+	bench("get_json META struct", [&]
+	{
+		buf.clear();
+		get_json(buf, OK, p);
+		g_sink += buf.size();
+	});
+
+	for (std::size_t count : { 4, 64 })
+	{
+		const std::vector<bench_point> points(count, p);
+		bench("get_json META structs/" + std::to_string(count), [&]
+		{
+			buf.clear();
+			get_json(buf, OK, points);
+			g_sink += buf.size();
+		});
+	}
+}
+
+void bench_client(boost::asio::io_service& io_service)
+{
+	client_proxy client(io_service);
+	bench("make_request_json add", [&]
+	{
+		g_sink += client.make_json("add", 1, 2).size();
+	});
+
+	bench("make_request_json ints/16", [&]
+	{
+		g_sink += client.make_json("sum16", 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16).size();
+	});
+
+	for (std::size_t size : { 16, 1024, 65536 })
+	{
+		const std::string s(size, 'x');
+		bench("make_request_json string/" + std::to_string(size), [&]
+		{
+			g_sink += client.make_json("echo", s).size();
+		});
+	}
+
+	const bench_point p = point(7);
+	bench("make_request_json META struct", [&]
+	{
+		g_sink += client.make_json("move", p).size();
+	});
+}
+
+int main()
+{
+	boost::asio::io_service io_service;
+	buffer_pool pool;
+
+	bench_parser();
+	bench_router(io_service, pool);
+	bench_get_json();
+	bench_client(io_service);
+	return 0;
+}
@@ -0,0 +1,812 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <limits>
+#include <utility>
+#include <functional>
+#include <type_traits>
+#include <stdexcept>
+#include <boost/utility/string_ref.hpp>
+
+//a compact binary encoding in the style of MessagePack: every value starts with a type byte, small integers,
+//strings and containers carry their length in it. unlike MessagePack, multi-byte numbers and lengths are little-endian.
+//a struct with META is an array of its fields in declaration order, missing trailing fields keep their value.
+
+struct raw_json; //common.h, written as the string of its text
+
+template<typename T, typename = void>
+struct bin_has_meta : std::false_type {};
+
+template<typename T>
+struct bin_has_meta<T, decltype(void(std::declval<T&>().Meta()))> : std::true_type {};
+
+template<typename T, typename = void>
+struct bin_is_map : std::false_type {};
+
+template<typename T>
+struct bin_is_map<T, decltype(void(std::declval<typename T::key_type>()), void(std::declval<typename T::mapped_type>()))> : std::true_type {};
+
+template<typename T, typename = void>
+struct bin_is_sequence : std::false_type {};
+
+template<typename T>
+struct bin_is_sequence<T, decltype(void(std::declval<typename T::value_type>()), void(std::declval<const T&>().begin()), void(std::declval<const T&>().end()))>
+	: std::integral_constant<bool, !bin_is_map<T>::value && !std::is_same<T, std::string>::value> {};
+
+template<typename T>
+struct bin_is_tuple : std::false_type {};
+
+template<typename... Args>
+struct bin_is_tuple<std::tuple<Args...>> : std::true_type {};
+
+template<typename T1, typename T2>
+struct bin_is_tuple<std::pair<T1, T2>> : std::true_type {};
+
+//the fields in Meta() are name/reference pairs, the reference may be wrapped.
+template<typename T>
+T& bin_unwrap(std::reference_wrapper<T> r)
+{
+	return r.get();
+}
+
+template<typename T>
+T& bin_unwrap(T& r)
+{
+	return r;
+}
+
+enum bin_type
+{
+	BIN_NIL = 0xc0,
+	BIN_FALSE = 0xc2,
+	BIN_TRUE = 0xc3,
+	BIN_FLOAT32 = 0xca,
+	BIN_FLOAT64 = 0xcb,
+	BIN_UINT8 = 0xcc,
+	BIN_UINT16 = 0xcd,
+	BIN_UINT32 = 0xce,
+	BIN_UINT64 = 0xcf,
+	BIN_INT8 = 0xd0,
+	BIN_INT16 = 0xd1,
+	BIN_INT32 = 0xd2,
+	BIN_INT64 = 0xd3,
+	BIN_STR8 = 0xd9,
+	BIN_STR16 = 0xda,
+	BIN_STR32 = 0xdb,
+	BIN_ARRAY16 = 0xdc,
+	BIN_ARRAY32 = 0xdd,
+	BIN_MAP16 = 0xde,
+	BIN_MAP32 = 0xdf
+};
+
+class bin_writer
+{
+public:
+	explicit bin_writer(std::string& buf) : buf_(buf)
+	{
+	}
+
+	void write_nil()
+	{
+		put(BIN_NIL);
+	}
+
+	void write_array_head(std::size_t size)
+	{
+		if (size < 16)
+			put(0x90 | size);
+		else
+			put_size(size, BIN_ARRAY16, BIN_ARRAY32);
+	}
+
+	void write_map_head(std::size_t size)
+	{
+		if (size < 16)
+			put(0x80 | size);
+		else
+			put_size(size, BIN_MAP16, BIN_MAP32);
+	}
+
+	void write_str(const char* str, std::size_t size)
+	{
+		if (size < 32)
+		{
+			put(0xa0 | size);
+		}
+		else if (size <= 0xff)
+		{
+			put(BIN_STR8);
+			put_le(size, 1);
+		}
+		else
+		{
+			put_size(size, BIN_STR16, BIN_STR32);
+		}
+
+		buf_.append(str, size);
+	}
+
+	void write(bool b)
+	{
+		put(b ? BIN_TRUE : BIN_FALSE);
+	}
+
+	void write(const std::string& str)
+	{
+		write_str(str.data(), str.size());
+	}
+
+	void write(const char* str)
+	{
+		write_str(str, strlen(str));
+	}
+
+	void write(char* str)
+	{
+		write_str(str, strlen(str));
+	}
+
+	template<typename T>
+	void write(const T& t)
+	{
+		write_value(t, kind<T>());
+	}
+
+private:
+	template<int N> struct kind_tag {};
+	enum { SIGNED_KIND, UNSIGNED_KIND, FLOAT_KIND, ENUM_KIND, META_KIND, MAP_KIND, SEQUENCE_KIND, TUPLE_KIND, RAW_KIND };
+
+	template<typename T>
+	static auto kind()
+	{
+		return kind_tag<std::is_same<T, raw_json>::value ? RAW_KIND : std::is_enum<T>::value ? ENUM_KIND : std::is_floating_point<T>::value ? FLOAT_KIND :
+			std::is_integral<T>::value ? (std::is_signed<T>::value ? SIGNED_KIND : UNSIGNED_KIND) : bin_has_meta<T>::value ? META_KIND :
+			bin_is_map<T>::value ? MAP_KIND : bin_is_sequence<T>::value ? SEQUENCE_KIND : TUPLE_KIND>();
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<RAW_KIND>)
+	{
+		write(t.json);
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<SIGNED_KIND>)
+	{
+		std::int64_t v = t;
+		if (v >= 0)
+			write_uint(v);
+		else if (v >= -32)
+			put(static_cast<std::uint8_t>(v));
+		else if (v >= INT8_MIN)
+			put_int(v, BIN_INT8, 1);
+		else if (v >= INT16_MIN)
+			put_int(v, BIN_INT16, 2);
+		else if (v >= INT32_MIN)
+			put_int(v, BIN_INT32, 4);
+		else
+			put_int(v, BIN_INT64, 8);
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<UNSIGNED_KIND>)
+	{
+		write_uint(t);
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<FLOAT_KIND>)
+	{
+		if (sizeof(T) == sizeof(float))
+		{
+			float f = static_cast<float>(t);
+			std::uint32_t bits;
+			memcpy(&bits, &f, sizeof(bits));
+			put(BIN_FLOAT32);
+			put_le(bits, 4);
+		}
+		else
+		{
+			double d = static_cast<double>(t);
+			std::uint64_t bits;
+			memcpy(&bits, &d, sizeof(bits));
+			put(BIN_FLOAT64);
+			put_le(bits, 8);
+		}
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<ENUM_KIND>)
+	{
+		write(static_cast<typename std::underlying_type<T>::type>(t));
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<META_KIND>)
+	{
+		auto meta = const_cast<T&>(t).Meta();
+		write_array_head(std::tuple_size<decltype(meta)>::value);
+		write_fields(meta, std::make_index_sequence<std::tuple_size<decltype(meta)>::value>{});
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<MAP_KIND>)
+	{
+		write_map_head(t.size());
+		for (auto& pair : t)
+		{
+			write(pair.first);
+			write(pair.second);
+		}
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<SEQUENCE_KIND>)
+	{
+		write_array_head(t.size());
+		for (auto& v : t)
+			write(v);
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<TUPLE_KIND>)
+	{
+		static_assert(bin_is_tuple<T>::value, "the type can't be encoded, a struct needs META");
+		write_array_head(std::tuple_size<T>::value);
+		write_elements(t, std::make_index_sequence<std::tuple_size<T>::value>{});
+	}
+
+	template<typename Tuple, std::size_t... I>
+	void write_fields(Tuple& meta, std::index_sequence<I...>)
+	{
+		(void)std::initializer_list<int>{ (write(bin_unwrap(std::get<I>(meta).second)), 0)... };
+	}
+
+	template<typename Tuple, std::size_t... I>
+	void write_elements(const Tuple& t, std::index_sequence<I...>)
+	{
+		(void)std::initializer_list<int>{ (write(std::get<I>(t)), 0)... };
+	}
+
+	void write_uint(std::uint64_t v)
+	{
+		if (v < 0x80)
+		{
+			put(static_cast<std::uint8_t>(v));
+		}
+		else if (v <= 0xff)
+		{
+			put(BIN_UINT8);
+			put_le(v, 1);
+		}
+		else if (v <= 0xffff)
+		{
+			put(BIN_UINT16);
+			put_le(v, 2);
+		}
+		else if (v <= 0xffffffff)
+		{
+			put(BIN_UINT32);
+			put_le(v, 4);
+		}
+		else
+		{
+			put(BIN_UINT64);
+			put_le(v, 8);
+		}
+	}
+
+	void put_int(std::int64_t v, std::uint8_t type, std::size_t n)
+	{
+		put(type);
+		put_le(static_cast<std::uint64_t>(v), n);
+	}
+
+	void put_size(std::size_t size, std::uint8_t type16, std::uint8_t type32)
+	{
+		if (size <= 0xffff)
+		{
+			put(type16);
+			put_le(size, 2);
+		}
+		else
+		{
+			put(type32);
+			put_le(size, 4);
+		}
+	}
+
+	void put(std::uint8_t c)
+	{
+		buf_.push_back(static_cast<char>(c));
+	}
+
+	void put_le(std::uint64_t v, std::size_t n)
+	{
+		char bytes[8];
+		for (std::size_t i = 0; i < n; i++)
+			bytes[i] = static_cast<char>(v >> (8 * i));
+
+		buf_.append(bytes, n);
+	}
+
+	std::string& buf_;
+};
+
+class bin_reader
+{
+public:
+	bin_reader(const char* data, std::size_t length) : data_(reinterpret_cast<const std::uint8_t*>(data)), end_(data_ + length), depth_(0)
+	{
+	}
+
+	bool empty() const
+	{
+		return data_ == end_;
+	}
+
+	bool try_read_nil()
+	{
+		if (peek() != BIN_NIL)
+			return false;
+
+		++data_;
+		return true;
+	}
+
+	std::size_t read_array_head()
+	{
+		std::uint8_t type = take();
+		if ((type & 0xf0) == 0x90)
+			return type & 0x0f;
+
+		if (type == BIN_ARRAY16)
+			return take_le(2);
+
+		if (type == BIN_ARRAY32)
+			return take_le(4);
+
+		throw std::invalid_argument("array expected");
+	}
+
+	std::size_t read_map_head()
+	{
+		std::uint8_t type = take();
+		if ((type & 0xf0) == 0x80)
+			return type & 0x0f;
+
+		if (type == BIN_MAP16)
+			return take_le(2);
+
+		if (type == BIN_MAP32)
+			return take_le(4);
+
+		throw std::invalid_argument("map expected");
+	}
+
+	//the string is not copied, it points into the input.
+	void read_str(const char*& str, std::size_t& size)
+	{
+		std::uint8_t type = take();
+		if ((type & 0xe0) == 0xa0)
+			size = type & 0x1f;
+		else if (type == BIN_STR8)
+			size = take_le(1);
+		else if (type == BIN_STR16)
+			size = take_le(2);
+		else if (type == BIN_STR32)
+			size = take_le(4);
+		else
+			throw std::invalid_argument("string expected");
+
+		need(size);
+		str = reinterpret_cast<const char*>(data_);
+		data_ += size;
+	}
+
+	void read(std::string& str)
+	{
+		const char* p;
+		std::size_t size;
+		read_str(p, size);
+		str.assign(p, size);
+	}
+
+	void read(bool& b)
+	{
+		std::uint8_t type = take();
+		if (type != BIN_TRUE && type != BIN_FALSE)
+			throw std::invalid_argument("bool expected");
+
+		b = type == BIN_TRUE;
+	}
+
+	template<typename T>
+	void read(T& t)
+	{
+		read_value(t, kind<T>());
+	}
+
+	//the encoding which is not read yet.
+	boost::string_ref rest() const
+	{
+		return boost::string_ref(reinterpret_cast<const char*>(data_), end_ - data_);
+	}
+
+	//the encoding of the next value.
+	boost::string_ref read_raw()
+	{
+		const std::uint8_t* begin = data_;
+		skip();
+		return boost::string_ref(reinterpret_cast<const char*>(begin), data_ - begin);
+	}
+
+	//skip a value of any type.
+	void skip()
+	{
+		std::uint8_t type = peek();
+		if ((type & 0xe0) == 0xa0 || type == BIN_STR8 || type == BIN_STR16 || type == BIN_STR32)
+		{
+			const char* p;
+			std::size_t size;
+			read_str(p, size);
+		}
+		else if ((type & 0xf0) == 0x90 || type == BIN_ARRAY16 || type == BIN_ARRAY32)
+		{
+			if (++depth_ > MAX_DEPTH)
+				throw std::invalid_argument("nesting is too deep");
+
+			std::size_t size = read_array_head();
+			for (std::size_t i = 0; i < size; i++)
+				skip();
+
+			--depth_;
+		}
+		else if ((type & 0xf0) == 0x80 || type == BIN_MAP16 || type == BIN_MAP32)
+		{
+			if (++depth_ > MAX_DEPTH)
+				throw std::invalid_argument("nesting is too deep");
+
+			std::size_t size = read_map_head();
+			for (std::size_t i = 0; i < size * 2; i++)
+				skip();
+
+			--depth_;
+		}
+		else if (type == BIN_NIL || type == BIN_TRUE || type == BIN_FALSE)
+		{
+			++data_;
+		}
+		else
+		{
+			double ignored;
+			read_number(ignored);
+		}
+	}
+
+private:
+	enum { MAX_DEPTH = 256 };
+	template<int N> struct kind_tag {};
+	enum { NUMBER_KIND, ENUM_KIND, META_KIND, MAP_KIND, SEQUENCE_KIND, TUPLE_KIND };
+
+	template<typename T>
+	static auto kind()
+	{
+		return kind_tag<std::is_enum<T>::value ? ENUM_KIND : std::is_arithmetic<T>::value ? NUMBER_KIND : bin_has_meta<T>::value ? META_KIND :
+			bin_is_map<T>::value ? MAP_KIND : bin_is_sequence<T>::value ? SEQUENCE_KIND : TUPLE_KIND>();
+	}
+
+	template<typename T>
+	void read_value(T& t, kind_tag<NUMBER_KIND>)
+	{
+		read_number(t);
+	}
+
+	template<typename T>
+	void read_value(T& t, kind_tag<ENUM_KIND>)
+	{
+		typename std::underlying_type<T>::type v;
+		read_number(v);
+		t = static_cast<T>(v);
+	}
+
+	template<typename T>
+	void read_value(T& t, kind_tag<META_KIND>)
+	{
+		auto meta = t.Meta();
+		std::size_t size = read_array_head();
+		read_fields(meta, size, std::make_index_sequence<std::tuple_size<decltype(meta)>::value>{});
+		for (std::size_t i = std::tuple_size<decltype(meta)>::value; i < size; i++)
+			skip();
+	}
+
+	template<typename T>
+	void read_value(T& t, kind_tag<MAP_KIND>)
+	{
+		std::size_t size = read_map_head();
+		t.clear();
+		for (std::size_t i = 0; i < size; i++)
+		{
+			typename std::decay<typename T::key_type>::type key;
+			typename T::mapped_type value;
+			read(key);
+			read(value);
+			t.emplace(std::move(key), std::move(value));
+		}
+	}
+
+	template<typename T>
+	void read_value(T& t, kind_tag<SEQUENCE_KIND>)
+	{
+		std::size_t size = read_array_head();
+		t.clear();
+		for (std::size_t i = 0; i < size; i++)
+		{
+			typename T::value_type value;
+			read(value);
+			t.insert(t.end(), std::move(value));
+		}
+	}
+
+	template<typename T>
+	void read_value(T& t, kind_tag<TUPLE_KIND>)
+	{
+		static_assert(bin_is_tuple<T>::value, "the type can't be decoded, a struct needs META");
+		if (read_array_head() != std::tuple_size<T>::value)
+			throw std::invalid_argument("tuple size is not match");
+
+		read_elements(t, std::make_index_sequence<std::tuple_size<T>::value>{});
+	}
+
+	template<typename Tuple, std::size_t... I>
+	void read_fields(Tuple& meta, std::size_t size, std::index_sequence<I...>)
+	{
+		(void)std::initializer_list<int>{ (I < size ? (read(bin_unwrap(std::get<I>(meta).second)), 0) : 0)... };
+	}
+
+	template<typename Tuple, std::size_t... I>
+	void read_elements(Tuple& t, std::index_sequence<I...>)
+	{
+		(void)std::initializer_list<int>{ (read(std::get<I>(t)), 0)... };
+	}
+
+	//the checks of json_reader: an integer takes an integer in its range, a float or a bool is refused.
+	template<typename T>
+	void read_number(T& t)
+	{
+		std::uint8_t type = take();
+		if (type < 0x80)
+		{
+			set_integer(t, false, type, std::is_integral<T>());
+		}
+		else if (type >= BIN_UINT8 && type <= BIN_UINT64)
+		{
+			set_integer(t, false, take_le(std::size_t(1) << (type - BIN_UINT8)), std::is_integral<T>());
+		}
+		else if (type >= 0xe0 || (type >= BIN_INT8 && type <= BIN_INT64))
+		{
+			const std::int64_t v = type >= 0xe0 ? static_cast<std::int8_t>(type) : take_signed(std::size_t(1) << (type - BIN_INT8));
+			set_integer(t, v < 0, v < 0 ? 0 - static_cast<std::uint64_t>(v) : static_cast<std::uint64_t>(v), std::is_integral<T>());
+		}
+		else if (type == BIN_FLOAT32 || type == BIN_FLOAT64)
+		{
+			const double v = type == BIN_FLOAT32 ? take_float() : take_double();
+			set_float(t, v, std::is_integral<T>());
+		}
+		else
+		{
+			throw std::invalid_argument("number expected");
+		}
+	}
+
+	//v is the magnitude of the integer.
+	template<typename T>
+	static void set_integer(T& t, bool negative, std::uint64_t v, std::true_type)
+	{
+		const std::uint64_t max = static_cast<std::uint64_t>(std::numeric_limits<T>::max());
+		if (v > (negative ? (std::is_signed<T>::value ? max + 1 : 0) : max))
+			throw std::out_of_range("integer out of range");
+
+		t = static_cast<T>(negative ? 0 - v : v);
+	}
+
+	template<typename T>
+	static void set_integer(T& t, bool negative, std::uint64_t v, std::false_type)
+	{
+		t = negative ? -static_cast<T>(v) : static_cast<T>(v);
+	}
+
+	template<typename T>
+	static void set_float(T&, double, std::true_type)
+	{
+		throw std::invalid_argument("integer expected");
+	}
+
+	template<typename T>
+	static void set_float(T& t, double v, std::false_type)
+	{
+		t = static_cast<T>(v);
+	}
+
+	std::int64_t take_signed(std::size_t n)
+	{
+		std::uint64_t v = take_le(n);
+		const std::size_t shift = 64 - 8 * n;
+		return static_cast<std::int64_t>(v << shift) >> shift;
+	}
+
+	float take_float()
+	{
+		std::uint32_t bits = static_cast<std::uint32_t>(take_le(4));
+		float f;
+		memcpy(&f, &bits, sizeof(f));
+		return f;
+	}
+
+	double take_double()
+	{
+		std::uint64_t bits = take_le(8);
+		double d;
+		memcpy(&d, &bits, sizeof(d));
+		return d;
+	}
+
+	std::uint64_t take_le(std::size_t n)
+	{
+		need(n);
+		std::uint64_t v = 0;
+		for (std::size_t i = 0; i < n; i++)
+			v |= static_cast<std::uint64_t>(data_[i]) << (8 * i);
+
+		data_ += n;
+		return v;
+	}
+
+	std::uint8_t peek()
+	{
+		need(1);
+		return *data_;
+	}
+
+	std::uint8_t take()
+	{
+		need(1);
+		return *data_++;
+	}
+
+	void need(std::size_t n)
+	{
+		if (static_cast<std::size_t>(end_ - data_) < n)
+			throw std::invalid_argument("unexpected end of input");
+	}
+
+	const std::uint8_t* data_;
+	const std::uint8_t* end_;
+	std::size_t depth_;
+};
+
+//the binary counterpart of token_parser, a request is a map with one entry: the handler name and the array of arguments.
+class bin_parser
+{
+public:
+	bin_parser() : reader_(nullptr, 0), name_(nullptr), name_size_(0), param_size_(0), taken_(0)
+	{
+	}
+
+	void parse(const char* s, std::size_t length)
+	{
+		reader_ = bin_reader(s, length);
+		if (reader_.read_map_head() != 1)
+			throw std::invalid_argument("invalid request");
+
+		reader_.read_str(name_, name_size_);
+		param_size_ = reader_.read_array_head() + 1;
+		taken_ = 0;
+		if (param_size_ == 1)
+			finish();
+	}
+
+	template<typename RequestedType>
+	typename std::decay<RequestedType>::type get()
+	{
+		typename std::decay<RequestedType>::type result;
+		read(result);
+		return result;
+	}
+
+	template<typename T>
+	void read(T& t)
+	{
+		if (empty())
+			throw std::invalid_argument("parameter number is not match");
+
+		if (taken_++ == 0)
+		{
+			take_name(t);
+			return;
+		}
+
+		//the same errors as token_parser, a value out of range is an invalid argument.
+		try
+		{
+			reader_.read(t);
+		}
+		catch (std::invalid_argument& e)
+		{
+			throw std::invalid_argument(std::string("invalid argument: ") + e.what());
+		}
+		catch (std::out_of_range& e)
+		{
+			throw std::invalid_argument(std::string("invalid argument: ") + e.what());
+		}
+
+		if (empty())
+			finish();
+	}
+
+	//the handler name without a copy, it lives as long as the request.
+	boost::string_ref read_name()
+	{
+		if (taken_++ != 0)
+			throw std::invalid_argument("the handler name is taken");
+
+		return boost::string_ref(name_, name_size_);
+	}
+
+	//the next argument as it is encoded, e.g. a call of a batch.
+	boost::string_ref read_raw()
+	{
+		if (taken_ == 0 || empty())
+			throw std::invalid_argument("parameter number is not match");
+
+		++taken_;
+		boost::string_ref raw = reader_.read_raw();
+		if (empty())
+			finish();
+
+		return raw;
+	}
+
+	//the encoding of the arguments left.
+	boost::string_ref raw_args() const
+	{
+		return reader_.rest();
+	}
+
+	bool empty() const { return taken_ == param_size_; }
+
+	std::size_t param_size()
+	{
+		return param_size_ - taken_;
+	}
+
+private:
+	bin_parser(const bin_parser&) = delete;
+	bin_parser(bin_parser&&) = delete;
+
+	void take_name(std::string& name)
+	{
+		name.assign(name_, name_size_);
+	}
+
+	template<typename T>
+	void take_name(T&)
+	{
+		throw std::invalid_argument("the handler name is a string");
+	}
+
+	//the arguments are read, the request ends after them.
+	void finish()
+	{
+		if (!reader_.rest().empty())
+			throw std::invalid_argument("unexpected bytes after the end");
+	}
+
+	bin_reader reader_;
+	const char* name_;
+	std::size_t name_size_;
+	std::size_t param_size_;
+	std::size_t taken_;
+};
@@ -0,0 +1,249 @@
+#pragma once
+#include <cstddef>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <boost/noncopyable.hpp>
+
+class buffer_pool;
+
+//a buffer taken from a buffer_pool, it goes back to the pool when released or destroyed.
+class pooled_buffer : private boost::noncopyable
+{
+public:
+	pooled_buffer() : pool_(nullptr), data_(nullptr), capacity_(0)
+	{
+	}
+
+	pooled_buffer(buffer_pool* pool, char* data, std::size_t capacity) : pool_(pool), data_(data), capacity_(capacity)
+	{
+	}
+
+	pooled_buffer(pooled_buffer&& other) : pool_(other.pool_), data_(other.data_), capacity_(other.capacity_)
+	{
+		other.pool_ = nullptr;
+		other.data_ = nullptr;
+		other.capacity_ = 0;
+	}
+
+	pooled_buffer& operator=(pooled_buffer&& other)
+	{
+		if (this != &other)
+		{
+			release();
+			std::swap(pool_, other.pool_);
+			std::swap(data_, other.data_);
+			std::swap(capacity_, other.capacity_);
+		}
+
+		return *this;
+	}
+
+	~pooled_buffer()
+	{
+		release();
+	}
+
+	char* data() const
+	{
+		return data_;
+	}
+
+	std::size_t capacity() const
+	{
+		return capacity_;
+	}
+
+	explicit operator bool() const
+	{
+		return data_ != nullptr;
+	}
+
+	inline void release();
+
+private:
+	buffer_pool* pool_;
+	char* data_;
+	std::size_t capacity_;
+};
+
+//free lists of buffers in power of two size classes, one pool for each io_service.
+//buffers larger than the biggest class are not pooled, and every class keeps at most MAX_FREE_NUM buffers.
+class buffer_pool : private boost::noncopyable
+{
+public:
+	enum { MIN_CLASS_SHIFT = 8, MAX_CLASS_SHIFT = 20, CLASS_NUM = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1, MAX_FREE_NUM = 64 };
+
+	buffer_pool() = default;
+
+	~buffer_pool()
+	{
+		for (auto& list : free_lists_)
+		{
+			for (char* data : list)
+				delete[] data;
+		}
+	}
+
+	pooled_buffer take(std::size_t size)
+	{
+		const std::size_t index = class_index(size);
+		if (index == CLASS_NUM)
+			return pooled_buffer(this, new char[size], size);
+
+		const std::size_t capacity = class_size(index);
+		{
+			std::unique_lock<std::mutex> lock(mtx_);
+			auto& list = free_lists_[index];
+			if (!list.empty())
+			{
+				char* data = list.back();
+				list.pop_back();
+				return pooled_buffer(this, data, capacity);
+			}
+		}
+
+		return pooled_buffer(this, new char[capacity], capacity);
+	}
+
+	void give_back(char* data, std::size_t capacity)
+	{
+		const std::size_t index = class_index(capacity);
+		if (index < CLASS_NUM && class_size(index) == capacity)
+		{
+			std::unique_lock<std::mutex> lock(mtx_);
+			auto& list = free_lists_[index];
+			if (list.size() < MAX_FREE_NUM)
+			{
+				list.push_back(data);
+				return;
+			}
+		}
+
+		delete[] data;
+	}
+
+private:
+	static std::size_t class_size(std::size_t index)
+	{
+		return std::size_t(1) << (index + MIN_CLASS_SHIFT);
+	}
+
+	static std::size_t class_index(std::size_t size)
+	{
+		std::size_t index = 0;
+		while (index < CLASS_NUM && class_size(index) < size)
+			++index;
+
+		return index;
+	}
+
+	//only the thread of the io_service takes and gives back in the common case, so the lock is not contended.
+	std::mutex mtx_;
+	std::vector<char*> free_lists_[CLASS_NUM];
+};
+
+inline void pooled_buffer::release()
+{
+	if (data_ == nullptr)
+		return;
+
+	pool_->give_back(data_, capacity_);
+	pool_ = nullptr;
+	data_ = nullptr;
+	capacity_ = 0;
+}
+
+//strings whose capacity is used again for response bodies, one free list for each thread.
+//a body is often taken by a worker and given back by an io thread, so the lists are balanced through a shared one:
+//a thread whose list is full moves a batch to it and a thread whose list is empty takes a batch from it.
+//the lock is taken once for a batch, the shared list is bounded and the strings it has no room for are freed.
+class string_pool
+{
+public:
+	enum { MAX_FREE_NUM = 64, BATCH_NUM = 32, MAX_SHARED_NUM = 1024, MAX_CAPACITY = 64 * 1024 };
+
+	static std::string take()
+	{
+		auto& list = free_list();
+		if (list.empty())
+			refill(list);
+
+		if (list.empty())
+			return std::string();
+
+		std::string str = std::move(list.back());
+		list.pop_back();
+		return str;
+	}
+
+	static void give_back(std::string&& str)
+	{
+		if (str.capacity() > MAX_CAPACITY)
+			return;
+
+		auto& list = free_list();
+		if (list.size() >= MAX_FREE_NUM)
+			spill(list);
+
+		str.clear();
+		list.push_back(std::move(str));
+	}
+
+private:
+	struct shared_list
+	{
+		shared_list() : size(0)
+		{
+		}
+
+		std::mutex mtx;
+		std::vector<std::string> strings;
+		std::atomic<std::size_t> size; //of strings, read without the lock so an empty list costs no lock
+	};
+
+	static std::vector<std::string>& free_list()
+	{
+		static thread_local std::vector<std::string> list;
+		return list;
+	}
+
+	static shared_list& shared()
+	{
+		static shared_list shared;
+		return shared;
+	}
+
+	static void refill(std::vector<std::string>& list)
+	{
+		auto& s = shared();
+		if (s.size.load(std::memory_order_relaxed) == 0)
+			return;
+
+		std::unique_lock<std::mutex> lock(s.mtx);
+		const std::size_t n = std::min<std::size_t>(BATCH_NUM, s.strings.size());
+		for (std::size_t i = s.strings.size() - n; i < s.strings.size(); i++)
+			list.push_back(std::move(s.strings[i]));
+
+		s.strings.resize(s.strings.size() - n);
+		s.size.store(s.strings.size(), std::memory_order_relaxed);
+	}
+
+	static void spill(std::vector<std::string>& list)
+	{
+		std::vector<std::string> batch;
+		batch.reserve(BATCH_NUM);
+		for (std::size_t i = list.size() - BATCH_NUM; i < list.size(); i++)
+			batch.push_back(std::move(list[i]));
+
+		list.resize(list.size() - BATCH_NUM);
+		auto& s = shared();
+		std::unique_lock<std::mutex> lock(s.mtx);
+		for (std::size_t i = 0; i < batch.size() && s.strings.size() < MAX_SHARED_NUM; i++)
+			s.strings.push_back(std::move(batch[i]));
+
+		s.size.store(s.strings.size(), std::memory_order_relaxed);
+	}
+};
@@ -1,65 +1,38 @@
 #pragma once
 #include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <functional>
 #include <kapok/Kapok.hpp>
 #include <boost/asio.hpp>
 #include <boost/asio/spawn.hpp>
 
 #include <boost/bind.hpp>
 #include <boost/smart_ptr.hpp>
+#include "../bin_codec.hpp"
 
 
 using boost::asio::ip::tcp;
 
-#include <boost/asio/yield.hpp>
-template<typename HandlerT>
-struct call_detail :
-	public boost::enable_shared_from_this<call_detail<HandlerT>>,
-	boost::asio::coroutine
-{
-	call_detail(const std::string& json_str, tcp::socket& socket, HandlerT handler)
-		:json_str_(json_str), len_(json_str.size()), socket_(socket), handler_(handler)
-	{
-		message_.push_back(boost::asio::buffer(&len_, 4));
-		message_.push_back(boost::asio::buffer(json_str_));
-	}
-	void do_call(boost::system::error_code const& ec)
-	{
-#define __CHECK_RETURN()	if (ec) {handler_(ec, std::string());return;}
-
-		reenter(this)
-		{
-			yield socket_.async_send(message_, boost::bind(&call_detail<HandlerT>::do_call, this->shared_from_this(), boost::asio::placeholders::error));
-			__CHECK_RETURN();
-			message_.clear();
-			yield socket_.async_receive(boost::asio::buffer(&len_, 4), boost::bind(&call_detail<HandlerT>::do_call, this->shared_from_this(), boost::asio::placeholders::error));
-			__CHECK_RETURN();
-			recv_json_.resize(len_);
-			yield socket_.async_receive(boost::asio::buffer(&recv_json_[0], len_), boost::bind(&call_detail<HandlerT>::do_call, this->shared_from_this(), boost::asio::placeholders::error));
-			__CHECK_RETURN();
-			handler_(ec, recv_json_);
-		}
-	}
-
-private:
-	int len_;
-	std::vector<boost::asio::const_buffer> message_;
-	std::string recv_json_;
-	std::string json_str_;
-
-	tcp::socket& socket_;
-	HandlerT handler_;
-};
-#include <boost/asio/unyield.hpp>
 
 #include <boost/lambda/bind.hpp>
 #include <boost/lambda/lambda.hpp>
 
 class client_proxy : private boost::noncopyable
 {
+	//the same head as the server's msg_head: body length followed by the request id.
+	struct msg_head
+	{
+		std::uint32_t len;
+		std::uint32_t id;
+	};
+
 public:
 	client_proxy(boost::asio::io_service& io_service)
 		: io_service_(io_service),
-		socket_(io_service)
+		socket_(io_service), binary_(false), next_id_(0), async_calls_(0), reading_(false), writing_(0), batch_max_(0), batch_timer_(io_service), batch_timer_armed_(false), batch_generation_(0)
 	{}
 
 	template<typename... Args>
@@ -68,34 +41,90 @@ public:
 		return make_request_json(handler_name, std::forward<Args>(args)...);
 	}
 
+	//it reads the socket itself, so it can't be made while async calls wait for their responses on it.
 	std::string call(const std::string& json_str)
 	{
-		int len = json_str.length();
-		bool r = send(json_str);
+		if (async_calls_.load() != 0)
+			throw std::logic_error("a call can't be made while async calls are in flight");
+
+		const std::uint32_t id = next_id();
+		bool r = send(id, json_str);
 		if (!r)
 			throw std::runtime_error("call failed");
-		
-		socket_.receive(boost::asio::buffer(&len, 4));
+
+		//skip the messages which don't belong to this call, e.g. pushed topics.
+		msg_head head = {};
 		std::string recv_json;
-		recv_json.resize(len);
-		socket_.receive(boost::asio::buffer(&recv_json[0], len));
+		do
+		{
+			boost::asio::read(socket_, boost::asio::buffer(&head, sizeof(msg_head)));
+			recv_json.resize(head.len);
+			if (head.len > 0)
+				boost::asio::read(socket_, boost::asio::buffer(&recv_json[0], head.len));
+		} while (head.id != id);
+
 		return recv_json;
 	}
 
+	//the response is matched with the call by request id, so many calls can be in flight on the connection.
 	template<typename HandlerT>
 	void async_call(const std::string& json_str, HandlerT handler)
 	{
-		auto helper = boost::make_shared<call_detail<HandlerT>>(json_str, socket_, handler);
-		helper->do_call({});
+		const std::uint32_t id = next_id();
+		auto frame = make_frame(id, json_str);
+		++async_calls_;
+		io_service_.post([this, id, frame, handler]() mutable
+		{
+			pending_calls_.emplace(id, handler);
+			send_queue_.push_back(std::move(frame));
+			if (writing_ == 0)
+				flush_or_wait();
+
+			if (!reading_)
+				read_head();
+		});
+	}
+
+	//the async calls are held until max_calls of them are queued or for window_micro microseconds after the first one,
+	//then they are sent together by one write. it saves syscalls and packets when many small calls are made at once,
+	//at the cost of the wait. the calls are still separate requests, 0 turns it off. set it before the calls are made.
+	void set_batching(std::size_t max_calls, std::size_t window_micro)
+	{
+		batch_max_ = max_calls;
+		batch_window_ = boost::posix_time::microseconds(window_micro);
 	}
 
 	template<typename... Args>
 	std::string call(const char* handler_name, Args&&... args)
 	{
-		auto json_str = make_request_json(handler_name, std::forward<Args>(args)...);
+		auto json_str = make_request(handler_name, std::forward<Args>(args)...);
 		return call(json_str);
 	}
 
+	//a request of call_batch, encoded by the codec of the connection.
+	template<typename... Args>
+	std::string make_call(const char* handler_name, Args&&... args)
+	{
+		return make_request(handler_name, std::forward<Args>(args)...);
+	}
+
+	//the calls are sent in one frame, the result is an array of their response_msg in the same order.
+	std::string call_batch(const std::vector<std::string>& requests)
+	{
+		return call(make_batch(requests));
+	}
+
+	//after it the requests are encoded by bin_writer and the results are binary response_msg, decode them by bin_reader.
+	void use_binary_codec()
+	{
+		DeSerializer dr;
+		dr.Parse(call("__codec", "binary"));
+		if (dr.GetDocument()["code"].GetInt() != 0)
+			throw std::runtime_error("the server doesn't support the binary codec");
+
+		binary_ = true;
+	}
+
 	std::string sub(const std::string& topic)
 	{
 		return call("sub_timax", topic);
@@ -104,8 +133,8 @@ public:
 	template<typename... Args>
 	void pub(const char* handler_name, Args&&... args)
 	{
-		auto json_str = make_request_json(handler_name, std::forward<Args>(args)...);
-		send(json_str);
+		auto json_str = make_request(handler_name, std::forward<Args>(args)...);
+		send(next_id(), json_str);
 	}
 
 	template<typename HandlerT, typename... Args>
@@ -195,14 +224,14 @@ public:
 	size_t recieve()
 	{
 		boost::system::error_code ec;
-		boost::asio::read(socket_, boost::asio::buffer(head_), ec);
+		boost::asio::read(socket_, boost::asio::buffer(&head_, sizeof(msg_head)), ec);
 		if (ec)
 		{
 			//log
 			return 0;
 		}
 		
-		const int body_len = *(int*)head_;
+		const int body_len = head_.len;
 		if (body_len <= 0 || body_len>max_length)
 			return 0;
 
@@ -226,7 +255,7 @@ private:
 	template<typename HandlerT, typename... Args>
 	void async_call_impl(const char* handler_name, HandlerT handler, Args&&... args)
 	{
-		auto json_str = make_request_json(handler_name, std::forward<Args>(args)...);
+		auto json_str = make_request(handler_name, std::forward<Args>(args)...);
 		async_call(json_str, handler);
 	}
 
@@ -303,12 +332,198 @@ private:
 		return make_request_json(handler_name, tp);
 	}
 
-	bool send(const std::string& json_str)
+	template<typename... Args>
+	std::string make_request(const char* handler_name, Args&&... args)
+	{
+		if (binary_)
+			return make_request_bin(handler_name, std::forward<Args>(args)...);
+
+		return make_request_json(handler_name, std::forward<Args>(args)...);
+	}
+
+	template<typename... Args>
+	std::string make_request_bin(const char* handler_name, Args&&... args)
+	{
+		std::string buf;
+		bin_writer wr(buf);
+		wr.write_map_head(1);
+		wr.write(handler_name);
+		wr.write_array_head(sizeof...(Args));
+		(void)std::initializer_list<int>{ (wr.write(args), 0)... };
+		return buf;
+	}
+
+	std::string make_batch(const std::vector<std::string>& requests)
+	{
+		std::string buf;
+		if (binary_)
+		{
+			bin_writer wr(buf);
+			wr.write_map_head(1);
+			wr.write("__batch");
+			wr.write_array_head(requests.size());
+			for (auto& r : requests)
+				buf.append(r);
+
+			return buf;
+		}
+
+		buf.append("{\"__batch\":[");
+		for (std::size_t i = 0; i < requests.size(); i++)
+		{
+			if (i != 0)
+				buf.push_back(',');
+
+			buf.append(requests[i]);
+		}
+
+		buf.append("]}");
+		return buf;
+	}
+
+	std::uint32_t next_id()
+	{
+		std::uint32_t id = ++next_id_;
+		if (id == 0) //0 is for pushed messages
+			id = ++next_id_;
+
+		return id;
+	}
+
+	static std::string make_frame(std::uint32_t id, const std::string& json_str)
+	{
+		msg_head head = { static_cast<std::uint32_t>(json_str.length()), id };
+		std::string frame;
+		frame.reserve(sizeof(msg_head) + json_str.length());
+		frame.append((const char*)&head, sizeof(msg_head));
+		frame.append(json_str);
+		return frame;
+	}
+
+	void flush_or_wait()
+	{
+		if (batch_max_ == 0 || send_queue_.size() >= batch_max_)
+		{
+			if (batch_timer_armed_)
+			{
+				batch_timer_armed_ = false;
+				++batch_generation_;
+				boost::system::error_code ignored_ec;
+				batch_timer_.cancel(ignored_ec);
+			}
+
+			write();
+			return;
+		}
+
+		if (batch_timer_armed_)
+			return;
+
+		//a completion queued before the cancel still comes with no error, the generation tells it is stale.
+		batch_timer_armed_ = true;
+		const std::uint64_t generation = ++batch_generation_;
+		batch_timer_.expires_from_now(batch_window_);
+		batch_timer_.async_wait([this, generation](boost::system::error_code ec)
+		{
+			if (ec || generation != batch_generation_)
+				return;
+
+			batch_timer_armed_ = false;
+			if (writing_ == 0 && !send_queue_.empty())
+				write();
+		});
+	}
+
+	//all the queued frames go out in one gathered write, the ones queued meanwhile are batched again after it.
+	void write()
+	{
+		writing_ = send_queue_.size();
+		std::vector<boost::asio::const_buffer> buffers;
+		buffers.reserve(writing_);
+		for (auto& frame : send_queue_)
+			buffers.push_back(boost::asio::buffer(frame));
+
+		boost::asio::async_write(socket_, buffers, [this](boost::system::error_code ec, std::size_t)
+		{
+			if (ec)
+			{
+				writing_ = 0;
+				send_queue_.clear();
+				fail_pending_calls(ec);
+				return;
+			}
+
+			send_queue_.erase(send_queue_.begin(), send_queue_.begin() + writing_);
+			writing_ = 0;
+			if (!send_queue_.empty())
+				flush_or_wait();
+		});
+	}
+
+	void read_head()
 	{
-		int len = json_str.length();
+		reading_ = true;
+		boost::asio::async_read(socket_, boost::asio::buffer(&recv_head_, sizeof(msg_head)), [this](boost::system::error_code ec, std::size_t)
+		{
+			if (ec)
+			{
+				fail_pending_calls(ec);
+				return;
+			}
+
+			recv_body_.resize(recv_head_.len);
+			if (recv_head_.len == 0)
+			{
+				on_response(ec);
+				return;
+			}
+
+			boost::asio::async_read(socket_, boost::asio::buffer(&recv_body_[0], recv_head_.len), [this](boost::system::error_code ec, std::size_t)
+			{
+				if (ec)
+				{
+					fail_pending_calls(ec);
+					return;
+				}
+
+				on_response(ec);
+			});
+		});
+	}
+
+	void on_response(const boost::system::error_code& ec)
+	{
+		auto it = pending_calls_.find(recv_head_.id);
+		if (it != pending_calls_.end()) //otherwise a pushed message or a call nobody waits for
+		{
+			auto handler = std::move(it->second);
+			pending_calls_.erase(it);
+			--async_calls_;
+			handler(ec, recv_body_);
+		}
+
+		if (pending_calls_.empty())
+			reading_ = false;
+		else
+			read_head();
+	}
+
+	void fail_pending_calls(const boost::system::error_code& ec)
+	{
+		reading_ = false;
+		auto calls = std::move(pending_calls_);
+		pending_calls_.clear();
+		async_calls_ -= calls.size();
+		for (auto& call : calls)
+			call.second(ec, std::string());
+	}
+
+	bool send(std::uint32_t id, const std::string& json_str)
+	{
+		msg_head head = { static_cast<std::uint32_t>(json_str.length()), id };
 
 		std::vector<boost::asio::const_buffer> message;
-		message.push_back(boost::asio::buffer(&len, 4));
+		message.push_back(boost::asio::buffer(&head, sizeof(msg_head)));
 		message.push_back(boost::asio::buffer(json_str));
 		boost::system::error_code ec;
 		boost::asio::write(socket_, message, ec);
@@ -328,8 +543,23 @@ private:
 
 	boost::asio::io_service& io_service_;
 	tcp::socket socket_;
+	bool binary_;
 	enum { max_length = 8192 };
-	char head_[4];
+	msg_head head_;
 	char recv_data_[max_length];
+
+	std::atomic<std::uint32_t> next_id_;
+	std::atomic<std::size_t> async_calls_; //made and not answered yet, counted from before they are posted
+	std::map<std::uint32_t, std::function<void(boost::system::error_code, std::string)>> pending_calls_;
+	std::deque<std::string> send_queue_;
+	msg_head recv_head_;
+	std::string recv_body_;
+	bool reading_;
+	std::size_t writing_;
+	std::size_t batch_max_;
+	boost::posix_time::time_duration batch_window_;
+	boost::asio::deadline_timer batch_timer_;
+	bool batch_timer_armed_;
+	std::uint64_t batch_generation_;
 };
 
@@ -0,0 +1,320 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/lexical_cast.hpp>
+#include "client_proxy.hpp"
+#include "../handler_stats.hpp"
+
+//a load generator for a rest_rpc server: every connection keeps up to outstanding calls in flight.
+//closed loop (rate 0): a call is made as soon as one is answered, the latency is from sending to the response.
+//open loop: the calls are due at a fixed rate spread over the connections, the latency is from the time a call was due,
+//so a call held back by a slow server is counted with its wait (no coordinated omission).
+struct loadgen_options
+{
+	std::string host = "127.0.0.1";
+	std::string port = "9000";
+	std::size_t connections = 1;
+	std::size_t outstanding = 1;
+	std::size_t threads = 1;
+	double rate = 0; //calls per second of all the connections
+	std::size_t warmup = 1;
+	std::size_t duration = 10;
+	std::string handler = "translate";
+	std::string args; //the json array of the arguments, a string of payload bytes if empty
+	std::size_t payload = 16;
+	bool binary = false;
+};
+
+typedef std::chrono::steady_clock clock_type;
+
+class load_connection
+{
+public:
+	load_connection(boost::asio::io_service& io_service, const loadgen_options& options)
+		: options_(options), client_(io_service), timer_(io_service), timer_armed_(false), outstanding_(0), calls_(0), errors_(0), finished_(false)
+	{
+	}
+
+	void connect()
+	{
+		client_.connect(options_.host, options_.port);
+		if (options_.binary)
+			client_.use_binary_codec();
+
+		request_ = make_request();
+	}
+
+	//measured calls are the ones due in [from, until), no call is made from until.
+	void start(clock_type::time_point begin, clock_type::time_point from, clock_type::time_point until)
+	{
+		from_ = from;
+		until_ = until;
+		if (options_.rate <= 0)
+		{
+			for (std::size_t i = 0; i < options_.outstanding; i++)
+				call(begin);
+
+			return;
+		}
+
+		interval_ = std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(options_.connections / options_.rate));
+		next_ = begin;
+		send_due();
+	}
+
+	//true when every call due before until is answered.
+	bool finished() const
+	{
+		return finished_.load();
+	}
+
+	//read after the thread of the connection has stopped: the calls made and not answered and the due ones not made yet.
+	void collect(std::vector<std::uint64_t>& counts, std::uint64_t& max, std::uint64_t& calls, std::uint64_t& errors, std::uint64_t& unanswered) const
+	{
+		latency_.collect(counts, max);
+		calls += calls_;
+		errors += errors_;
+		unanswered += outstanding_;
+		const clock_type::time_point unsent = std::max(next_, from_);
+		if (options_.rate > 0 && unsent < until_)
+			unanswered += (until_ - unsent + interval_ - clock_type::duration(1)) / interval_;
+	}
+
+private:
+	std::string make_request()
+	{
+		if (options_.binary)
+			return client_.make_call(options_.handler.c_str(), std::string(options_.payload, 'x'));
+
+		std::string args = options_.args.empty() ? "[\"" + std::string(options_.payload, 'x') + "\"]" : options_.args;
+		return "{\"" + options_.handler + "\":" + args + "}";
+	}
+
+	void call(clock_type::time_point due)
+	{
+		if (due >= until_)
+			return;
+
+		++outstanding_;
+		client_.async_call(request_, [this, due](boost::system::error_code ec, std::string result)
+		{
+			on_response(ec, result, due);
+		});
+	}
+
+	void on_response(const boost::system::error_code& ec, const std::string& result, clock_type::time_point due)
+	{
+		const clock_type::time_point now = clock_type::now();
+		if (due >= from_)
+		{
+			++calls_;
+			if (ec || handler_stats::response_code(result) != OK)
+				++errors_;
+			else
+				latency_.record(std::chrono::duration_cast<std::chrono::microseconds>(now - due).count());
+		}
+
+		--outstanding_;
+		if (!ec)
+		{
+			if (options_.rate <= 0)
+				call(now);
+			else
+				send_due();
+		}
+
+		if (outstanding_ == 0 && (ec || options_.rate <= 0 || next_ >= until_))
+			finished_ = true;
+	}
+
+	//makes the calls which are due while fewer than outstanding are in flight, a late call keeps the time it was due.
+	void send_due()
+	{
+		const clock_type::time_point now = clock_type::now();
+		while (next_ <= now && next_ < until_ && outstanding_ < options_.outstanding)
+		{
+			call(next_);
+			next_ += interval_;
+		}
+
+		if (timer_armed_ || next_ <= now || next_ >= until_)
+			return;
+
+		timer_armed_ = true;
+		timer_.expires_from_now(boost::posix_time::microseconds(std::chrono::duration_cast<std::chrono::microseconds>(next_ - now).count()));
+		timer_.async_wait([this](boost::system::error_code ec)
+		{
+			timer_armed_ = false;
+			if (!ec)
+				send_due();
+		});
+	}
+
+	const loadgen_options& options_;
+	client_proxy client_;
+	std::string request_;
+	boost::asio::deadline_timer timer_;
+	bool timer_armed_;
+	clock_type::time_point from_;
+	clock_type::time_point until_;
+	clock_type::time_point next_;
+	clock_type::duration interval_;
+	std::size_t outstanding_;
+	std::uint64_t calls_;
+	std::uint64_t errors_;
+	std::atomic<bool> finished_;
+	latency_histogram latency_;
+};
+
+static void usage()
+{
+	std::cerr << "usage: loadgen [--host 127.0.0.1] [--port 9000] [--connections 1] [--outstanding 1] [--threads 1]\n"
+		"               [--rate 0] [--warmup 1] [--duration 10] [--handler translate] [--args '[1,2]'] [--payload 16] [--binary]\n"
+		"--rate is the calls per second of all the connections, 0 makes a call as soon as one is answered.\n"
+		"--args is the json array of the arguments, without it the argument is a string of --payload bytes.\n";
+}
+
+static bool parse_options(int argc, char* argv[], loadgen_options& options)
+{
+	try
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			const std::string name = argv[i];
+			if (name == "--binary")
+			{
+				options.binary = true;
+				continue;
+			}
+
+			if (i + 1 == argc)
+				return false;
+
+			const std::string value = argv[++i];
+			if (name == "--host")
+				options.host = value;
+			else if (name == "--port")
+				options.port = value;
+			else if (name == "--connections")
+				options.connections = boost::lexical_cast<std::size_t>(value);
+			else if (name == "--outstanding")
+				options.outstanding = boost::lexical_cast<std::size_t>(value);
+			else if (name == "--threads")
+				options.threads = boost::lexical_cast<std::size_t>(value);
+			else if (name == "--rate")
+				options.rate = boost::lexical_cast<double>(value);
+			else if (name == "--warmup")
+				options.warmup = boost::lexical_cast<std::size_t>(value);
+			else if (name == "--duration")
+				options.duration = boost::lexical_cast<std::size_t>(value);
+			else if (name == "--handler")
+				options.handler = value;
+			else if (name == "--args")
+				options.args = value;
+			else if (name == "--payload")
+				options.payload = boost::lexical_cast<std::size_t>(value);
+			else
+				return false;
+		}
+	}
+	catch (const boost::bad_lexical_cast&)
+	{
+		return false;
+	}
+
+	return options.connections > 0 && options.outstanding > 0 && options.threads > 0 && options.duration > 0 && !(options.binary && !options.args.empty());
+}
+
+int main(int argc, char* argv[])
+{
+	loadgen_options options;
+	if (!parse_options(argc, argv, options))
+	{
+		usage();
+		return 1;
+	}
+
+	std::vector<std::unique_ptr<boost::asio::io_service>> io_services;
+	for (std::size_t i = 0; i < options.threads; i++)
+		io_services.emplace_back(new boost::asio::io_service);
+
+	//a client_proxy is used by the thread of its io_service only.
+	std::vector<std::unique_ptr<load_connection>> connections;
+	try
+	{
+		for (std::size_t i = 0; i < options.connections; i++)
+		{
+			connections.emplace_back(new load_connection(*io_services[i % options.threads], options));
+			connections.back()->connect();
+		}
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "connect failed: " << e.what() << std::endl;
+		return 1;
+	}
+
+	const clock_type::time_point begin = clock_type::now();
+	const clock_type::time_point from = begin + std::chrono::seconds(options.warmup);
+	const clock_type::time_point until = from + std::chrono::seconds(options.duration);
+	for (std::size_t i = 0; i < options.connections; i++)
+	{
+		//the open loop connections start one after another, so their calls are spread over the interval.
+		auto start = begin + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(options.rate > 0 ? i / options.rate : 0));
+		auto conn = connections[i].get();
+		io_services[i % options.threads]->post([conn, start, from, until] { conn->start(start, from, until); });
+	}
+
+	std::vector<std::unique_ptr<boost::asio::io_service::work>> works;
+	std::vector<std::thread> threads;
+	for (auto& ios : io_services)
+	{
+		works.emplace_back(new boost::asio::io_service::work(*ios));
+		threads.emplace_back([&ios] { ios->run(); });
+	}
+
+	//the calls due before until are waited for a while, the ones still unanswered are reported.
+	std::this_thread::sleep_until(until);
+	const clock_type::time_point drain_until = until + std::chrono::seconds(5);
+	auto finished = [&connections]
+	{
+		for (auto& conn : connections)
+		{
+			if (!conn->finished())
+				return false;
+		}
+
+		return true;
+	};
+
+	while (!finished() && clock_type::now() < drain_until)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	for (auto& ios : io_services)
+		ios->stop();
+
+	for (auto& t : threads)
+		t.join();
+
+	std::vector<std::uint64_t> counts;
+	std::uint64_t max = 0, calls = 0, errors = 0, unanswered = 0;
+	for (auto& conn : connections)
+		conn->collect(counts, max, calls, errors, unanswered);
+
+	std::cout << "{\"handler\":\"" << options.handler << "\",\"codec\":\"" << (options.binary ? "binary" : "json")
+		<< "\",\"mode\":\"" << (options.rate > 0 ? "open" : "closed") << "\",\"connections\":" << options.connections
+		<< ",\"outstanding\":" << options.outstanding << ",\"rate\":" << options.rate << ",\"duration\":" << options.duration
+		<< ",\"calls\":" << calls << ",\"errors\":" << errors << ",\"unanswered\":" << unanswered
+		<< ",\"throughput\":" << static_cast<double>(calls) / options.duration
+		<< ",\"latency_us\":{\"p50\":" << latency_histogram::percentile(counts, max, 0.5)
+		<< ",\"p99\":" << latency_histogram::percentile(counts, max, 0.99)
+		<< ",\"p999\":" << latency_histogram::percentile(counts, max, 0.999) << ",\"max\":" << max << "}}" << std::endl;
+
+	return unanswered == 0 ? 0 : 2;
+}
@@ -184,6 +184,27 @@ void test_translate()
 	}
 }
 
+void test_binary()
+{
+	try
+	{
+		boost::asio::io_service io_service;
+		client_proxy client(io_service);
+		client.connect("127.0.0.1", "9000");
+		client.use_binary_codec();
+
+		std::string result = client.call("translate", "test");
+		bin_reader rd(result.data(), result.size());
+		response_msg<std::string> response = {};
+		rd.read(response);
+		std::cout << response.result << std::endl;
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "Exception: " << e.what() << std::endl;
+	}
+}
+
 void test_upload()
 {
 	try
@@ -322,5 +343,6 @@ int main()
 	test_translate();
 	//test_async_client();
 	//test_spawn_client();
+	//test_binary();
 	return 0;
 }
\ No newline at end of file
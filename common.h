@@ -1,11 +1,12 @@
 #pragma once
 #include <atomic>
 #include <cstdint>
+#include <string>
 #include <kapok/Kapok.hpp>
 
 //resultҪôǻͣҪôǽṹ壻ɹʱcodeΪ0, ޷͵ģresultΪ; 
 //зֵģresultΪֵresponse_msgлΪһ׼jsonطͻˡ 
-//Ϣĸʽlength+body4ֽڵĳϢָʾĳȣӰɡ 
+//Ϣĸʽhead+bodyhead8ֽڵmsg_head4ֽڵİ峤len4ֽڵidӦid 
 template<typename T>
 struct response_msg
 {
@@ -22,6 +23,38 @@ enum result_code
 	ARGUMENT_EXCEPTION = 3
 };
 
-static std::atomic<std::uint64_t> g_succeed_count(0); //for test qps
+//a result which is json text already, e.g. taken from a cache. a handler returning it has the text spliced into
+//the json response as the result, instead of escaping it into a string. a binary response carries it as a string.
+struct raw_json
+{
+	std::string json;
+};
+
+//message head: body length followed by the request id, a response carries the id of its request.
+//id 0 is reserved for messages pushed by the server, such as published topics.
+struct msg_head
+{
+	std::uint32_t len;
+	std::uint32_t id;
+};
+
+const int HEAD_LEN = sizeof(msg_head);
+
+//a connection starts with json, a "__codec" call with "binary" or "json" switches it for the calls after it.
+enum codec_type
+{
+	JSON_CODEC = 0,
+	BINARY_CODEC = 1
+};
+
+static const char* const CODEC_HANDSHAKE = "__codec";
+
+//{"__batch":[{"add":[1,2]},{"about":""}]} makes the calls in one frame, the response is an array of their response_msg.
+static const char* const BATCH_CALL = "__batch";
+
+//{"__stats":""} returns the calls, errors, bytes and latencies of each handler, an array of handler_stats_info.
+static const char* const STATS_CALL = "__stats";
+
+const int MAX_BUF_LEN = 8192; //size of the receive buffer a read starts with
 
-const int MAX_BUF_LEN = 8192;
\ No newline at end of file
+const std::size_t MAX_FRAME_LEN = 65536; //default limit of the body length, see server::set_max_frame_len
\ No newline at end of file
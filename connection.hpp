@@ -1,23 +1,31 @@
 #pragma once
 #include <iostream>
 #include <memory>
+#include <deque>
+#include <vector>
+#include <cstring>
 #include <boost/asio.hpp>
 #include <boost/asio/deadline_timer.hpp>
 #include "common.h"
+#include "buffer_pool.hpp"
+#include "tracer.hpp"
 
 using boost::asio::ip::tcp;
 
 class connection : public std::enable_shared_from_this<connection>, private boost::noncopyable
 {
 public:
-	connection(boost::asio::io_service& io_service, std::size_t timeout_milli) : socket_(io_service), message_{ boost::asio::buffer(head_),
-		boost::asio::buffer(data_) }, timer_(io_service), timeout_milli_(timeout_milli)
+	connection(boost::asio::io_service& io_service, buffer_pool& pool, std::size_t timeout_milli, std::size_t max_in_flight = 1,
+		std::size_t max_frame_len = MAX_FRAME_LEN) : io_service_(io_service), socket_(io_service), pool_(pool), recv_len_(0), read_start_(0), read_end_(0), timer_(io_service),
+		timeout_milli_(timeout_milli), in_flight_(0), max_in_flight_(max_in_flight == 0 ? 1 : max_in_flight), max_frame_len_(max_frame_len), read_paused_(false), codec_(JSON_CODEC)
 	{
 	}
 
 	void start()
 	{
-		read_head();
+		boost::system::error_code ignored_ec;
+		socket_.non_blocking(true, ignored_ec);
+		read();
 	}
 
 	tcp::socket& socket()
@@ -25,86 +33,253 @@ public:
 		return socket_;
 	}
 
-	void read_head()
+	codec_type codec() const
+	{
+		return codec_;
+	}
+
+	void set_codec(codec_type codec)
 	{
-		reset_timer();
+		codec_ = codec;
+	}
+
+	//wait until the socket is readable and only then take a receive buffer from the pool, so an idle connection holds no buffer.
+	//read whatever the socket has, a single read may bring many small requests.
+	//the idle timeout runs only while no request is in flight, a long call doesn't get its connection closed.
+	void read()
+	{
+		if (in_flight_ == 0)
+			reset_timer();
+		else
+			cancel_timer();
 		auto self(this->shared_from_this());
-		boost::asio::async_read(socket_, boost::asio::buffer(head_), [this, self](boost::system::error_code ec, std::size_t length)
+		socket_.async_read_some(boost::asio::null_buffers(), [this, self](boost::system::error_code ec, std::size_t)
 		{
+			cancel_timer();
+
 			if (!socket_.is_open())
+				return;
+
+			if (ec)
 			{
-				cancel_timer();
+				//log
 				return;
 			}
 
-			if (!ec)
+			if (!recv_buf_)
+				recv_buf_ = pool_.take(MAX_BUF_LEN);
+
+			read_start_ = tracer::get().enabled() ? tracer::now() : 0;
+			std::size_t length = socket_.read_some(boost::asio::buffer(recv_buf_.data() + recv_len_, recv_buf_.capacity() - recv_len_), ec);
+			if (ec == boost::asio::error::would_block)
 			{
-				const int body_len = *(int*)head_;
-				if (body_len > 0 && body_len< 65536)
-				{
-					read_body(body_len);
-					return;
-				}
+				if (recv_len_ == 0)
+					recv_buf_.release();
 
-				if (body_len == 0) //nobody, just head.
-				{
-					read_head();
-				}
-				else
-				{
-					//log //invalid body len
-					cancel_timer();
-				}
+				read();
+				return;
 			}
-			else
+
+			if (ec)
 			{
 				//log
-				cancel_timer();
+				return;
 			}
+
+			recv_len_ += length;
+			if (read_start_ != 0)
+				read_end_ = tracer::now();
+
+			handle_frames();
 		});
 	}
 
-	void read_body(std::size_t size)
+	//slice out every complete frame in the receive buffer, keep the incomplete tail and read again.
+	void handle_frames()
 	{
 		auto self(this->shared_from_this());
-		boost::asio::async_read(socket_, boost::asio::buffer(data_, size), [this, self](boost::system::error_code ec, std::size_t length)
+		std::size_t pos = 0;
+		while (recv_len_ - pos >= HEAD_LEN)
 		{
-			cancel_timer();
-
-			if (!socket_.is_open())
+			msg_head head;
+			memcpy(&head, recv_buf_.data() + pos, HEAD_LEN);
+			if (head.len > max_frame_len_)
+			{
+				//log //invalid body len
+				close();
 				return;
+			}
 
-			if (!ec)
+			if (recv_len_ - pos - HEAD_LEN < head.len)
+				break;
+
+			//the frames after the cap stay in the buffer, response resumes when a request is answered.
+			if (in_flight_ >= max_in_flight_)
 			{
-				router& _router = router::get();
-				_router.route(data_, length, self);
+				read_paused_ = true;
+				cancel_timer();
+				break;
 			}
-			else
+
+			const char* body = recv_buf_.data() + pos + HEAD_LEN;
+			pos += HEAD_LEN + head.len;
+			if (head.len == 0) //nobody, just head.
+				continue;
+
+			//responses carry the request id, so the next request can be handled before this one is answered.
+			++in_flight_;
+			trace_scope scope(sample(head.id));
+			trace_span span("route");
+			router& _router = router::get();
+			_router.route(body, head.len, head.id, self);
+		}
+
+		if (pos > 0)
+		{
+			recv_len_ -= pos;
+			memmove(recv_buf_.data(), recv_buf_.data() + pos, recv_len_);
+		}
+
+		if (recv_len_ == 0)
+		{
+			recv_buf_.release();
+		}
+		else if (recv_len_ >= HEAD_LEN) //the body length is known now, move to a buffer which can hold the whole frame
+		{
+			msg_head head;
+			memcpy(&head, recv_buf_.data(), HEAD_LEN);
+			if (HEAD_LEN + head.len > recv_buf_.capacity())
 			{
-				//log
+				auto buf = pool_.take(HEAD_LEN + head.len);
+				memcpy(buf.data(), recv_buf_.data(), recv_len_);
+				recv_buf_ = std::move(buf);
 			}
-		});
+		}
+
+		if (!read_paused_)
+			read();
+	}
+
+	void response(std::uint32_t id, const char* json_str)
+	{
+		response(id, json_str, strlen(json_str));
+	}
+
+	void response(std::uint32_t id, const std::string& body)
+	{
+		response(id, body.data(), body.size());
+	}
+
+	void response(std::uint32_t id, const char* body, std::size_t len)
+	{
+		std::string str = string_pool::take();
+		str.assign(body, len);
+		response(id, std::move(str));
 	}
 
 	//add timeout later
-	void response(const char* json_str)
+	//can be called from any thread, the frame is queued on the thread of the connection.
+	//the body is moved into the frame and goes back to the string_pool after it is written.
+	//every routed request is answered once, by this or by no_response, the answer ends it being in flight.
+	void response(std::uint32_t id, std::string&& body)
 	{
+		frame f = { { static_cast<std::uint32_t>(body.size()), id }, std::move(body), 0, 0 };
+
 		auto self(this->shared_from_this());
-		int len = strlen(json_str);
-		message_[0] = boost::asio::buffer(&len, 4);
-		message_[1] = boost::asio::buffer((char*)json_str, len);
-		boost::asio::async_write(socket_, message_, [this, self](boost::system::error_code ec, std::size_t length)
+		io_service_.dispatch([this, self, f = std::move(f)]() mutable
 		{
-			if (!ec)
+			if (!traced_.empty())
 			{
-				read_head();
+				f.trace = take_trace(f.head.id);
+				f.queued = f.trace != 0 ? tracer::now() : 0;
 			}
-			else
+
+			send_queue_.push_back(std::move(f));
+			if (sending_.empty())
+				write();
+
+			answered();
+		});
+	}
+
+	//a request which gets no answer, e.g. a publish whose result goes to the subscribers.
+	void no_response(std::uint32_t id)
+	{
+		auto self(this->shared_from_this());
+		io_service_.dispatch([this, self, id]
+		{
+			if (!traced_.empty())
+				take_trace(id);
+
+			answered();
+		});
+	}
+
+	//a frame which answers no request, e.g. a message published to a subscriber.
+	void push(const std::string& body)
+	{
+		std::string str = string_pool::take();
+		str.assign(body);
+		frame f = { { static_cast<std::uint32_t>(str.size()), 0 }, std::move(str), 0, 0 };
+
+		auto self(this->shared_from_this());
+		io_service_.dispatch([this, self, f = std::move(f)]() mutable
+		{
+			send_queue_.push_back(std::move(f));
+			if (sending_.empty())
+				write();
+		});
+	}
+
+	//samples a request for tracing, the read which brought it is its first stage. 0 if it is not traced.
+	std::uint64_t sample(std::uint32_t id)
+	{
+		const std::uint64_t trace = tracer::get().sample();
+		if (trace == 0)
+			return 0;
+
+		if (read_start_ != 0)
+			tracer::get().record("read", trace, read_start_, read_end_);
+
+		traced_.emplace_back(id, trace);
+		return trace;
+	}
+
+	//the trace of the request a response answers, the response is traced from its queueing until it is written.
+	std::uint64_t take_trace(std::uint32_t id)
+	{
+		for (auto it = traced_.begin(); it != traced_.end(); ++it)
+		{
+			if (it->first == id)
 			{
-				//log
+				const std::uint64_t trace = it->second;
+				traced_.erase(it);
+				return trace;
+			}
+		}
+
+		return 0;
+	}
+
+	//on the io thread. the frames held back by the cap are handled once a request under it is answered.
+	void answered()
+	{
+		--in_flight_;
+		if (!socket_.is_open())
+			return;
 
+		if (read_paused_)
+		{
+			if (in_flight_ < max_in_flight_)
+			{
+				read_paused_ = false;
+				handle_frames();
 			}
-		});
+		}
+		else if (in_flight_ == 0)
+		{
+			reset_timer();
+		}
 	}
 
 	void reset_timer()
@@ -141,17 +316,83 @@ public:
 		timer_.cancel();
 	}
 
+	//write every queued frame with one gathered write, responses finished meanwhile are sent by the next one.
+	void write()
+	{
+		sending_.swap(send_queue_);
+		send_buffers_.clear();
+		for (auto& f : sending_)
+		{
+			send_buffers_.push_back(boost::asio::buffer(&f.head, HEAD_LEN));
+			send_buffers_.push_back(boost::asio::buffer(f.body));
+		}
+
+		auto self(this->shared_from_this());
+		boost::asio::async_write(socket_, send_buffers_, [this, self](boost::system::error_code ec, std::size_t length)
+		{
+			std::uint64_t written = 0;
+			for (auto& f : sending_)
+			{
+				if (f.trace != 0)
+				{
+					written = written != 0 ? written : tracer::now();
+					tracer::get().record("write", f.trace, f.queued, written);
+				}
+
+				string_pool::give_back(std::move(f.body));
+			}
+
+			sending_.clear();
+			if (ec)
+			{
+				//log
+				send_queue_.clear();
+				return;
+			}
+
+			if (!send_queue_.empty())
+				write();
+		});
+	}
+
 	void close()
 	{
 		boost::system::error_code ignored_ec;
 		socket_.close(ignored_ec);
 	}
 
+	boost::asio::io_service& io_service_;
 	tcp::socket socket_;
-	char head_[4];
-	char data_[MAX_BUF_LEN];
-	std::array<boost::asio::mutable_buffer, 2> message_;
+	buffer_pool& pool_;
+	pooled_buffer recv_buf_;
+	std::size_t recv_len_;
+	std::uint64_t read_start_;
+	std::uint64_t read_end_;
+
+	//the head is sent as its own buffer, so the body is written without copying it behind the head.
+	//trace is nonzero if the frame answers a traced request, queued is the time it was queued then.
+	struct frame
+	{
+		msg_head head;
+		std::string body;
+		std::uint64_t trace;
+		std::uint64_t queued;
+	};
+
+	std::deque<frame> send_queue_;
+	std::deque<frame> sending_;
+	std::vector<boost::asio::const_buffer> send_buffers_;
 	boost::asio::deadline_timer timer_;
 	std::size_t timeout_milli_;
+
+	//the requests routed and not answered yet, on the io thread. reading pauses at max_in_flight_ of them.
+	std::size_t in_flight_;
+	std::size_t max_in_flight_;
+	std::size_t max_frame_len_;
+	bool read_paused_;
+	codec_type codec_;
+
+	//the ids of the traced requests which are not answered yet and their traces.
+	std::vector<std::pair<std::uint32_t, std::uint64_t>> traced_;
 };
 
@@ -21,6 +21,7 @@ public:
 	typedef Ret return_type;
 	using stl_function_type = std::function<function_type>;
 	typedef Ret(*pointer)(Args...);
+	using tuple_type = std::tuple<typename std::decay<Args>::type...>;
 
 	template<size_t I>
 	struct args
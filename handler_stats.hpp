@@ -0,0 +1,230 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <kapok/Kapok.hpp>
+#include "common.h"
+
+//the percentiles of a latency histogram, in microseconds.
+struct latency_info
+{
+	std::uint64_t count;
+	std::uint64_t p50;
+	std::uint64_t p90;
+	std::uint64_t p99;
+	std::uint64_t max;
+	META(count, p50, p90, p99, max);
+};
+
+//the stats of a handler returned by __stats. codes counts the responses by result_code, queue is the time a pooled
+//call waits for a worker and exec the time from the start of the handler to its response.
+struct handler_stats_info
+{
+	std::string name;
+	std::uint64_t calls;
+	std::vector<std::uint64_t> codes;
+	std::uint64_t bytes_in;
+	std::uint64_t bytes_out;
+	latency_info queue;
+	latency_info exec;
+	META(name, calls, codes, bytes_in, bytes_out, queue, exec);
+};
+
+//a histogram of microseconds like HdrHistogram: the values below 8 have a bucket each, above that every power of two
+//is split into 8 buckets, so a value is known within 1/8 with a few hundred counters.
+class latency_histogram
+{
+public:
+	enum { SUB_BITS = 3, SUB_NUM = 1 << SUB_BITS, MAX_EXP = 36, BUCKET_NUM = (MAX_EXP - SUB_BITS + 2) * SUB_NUM };
+
+	latency_histogram() : max_(0)
+	{
+		for (auto& b : buckets_)
+			b = 0;
+	}
+
+	void record(std::uint64_t micros)
+	{
+		buckets_[index(micros)].fetch_add(1, std::memory_order_relaxed);
+		std::uint64_t max = max_.load(std::memory_order_relaxed);
+		while (micros > max && !max_.compare_exchange_weak(max, micros, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	//adds the counts to the ones of the other shards.
+	void collect(std::vector<std::uint64_t>& counts, std::uint64_t& max) const
+	{
+		counts.resize(BUCKET_NUM);
+		for (std::size_t i = 0; i < BUCKET_NUM; i++)
+			counts[i] += buckets_[i].load(std::memory_order_relaxed);
+
+		max = std::max(max, max_.load(std::memory_order_relaxed));
+	}
+
+	//a percentile is the highest value of its bucket.
+	static latency_info percentiles(const std::vector<std::uint64_t>& counts, std::uint64_t max)
+	{
+		latency_info info = {};
+		for (auto c : counts)
+			info.count += c;
+
+		info.max = max;
+		if (info.count == 0)
+			return info;
+
+		const std::uint64_t ranks[] = { (info.count * 50 + 99) / 100, (info.count * 90 + 99) / 100, (info.count * 99 + 99) / 100 };
+		std::uint64_t* values[] = { &info.p50, &info.p90, &info.p99 };
+		std::uint64_t seen = 0;
+		std::size_t r = 0;
+		for (std::size_t i = 0; i < counts.size() && r < 3; i++)
+		{
+			seen += counts[i];
+			while (r < 3 && seen >= ranks[r])
+				*values[r++] = std::min(lowest(i + 1) - 1, max);
+		}
+
+		return info;
+	}
+
+	//the value which the fraction q of the counted values don't exceed, e.g. 0.999 for p99.9.
+	static std::uint64_t percentile(const std::vector<std::uint64_t>& counts, std::uint64_t max, double q)
+	{
+		std::uint64_t count = 0;
+		for (auto c : counts)
+			count += c;
+
+		if (count == 0)
+			return 0;
+
+		const std::uint64_t rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(count * q)));
+		std::uint64_t seen = 0;
+		for (std::size_t i = 0; i < counts.size(); i++)
+		{
+			seen += counts[i];
+			if (seen >= rank)
+				return std::min(lowest(i + 1) - 1, max);
+		}
+
+		return max;
+	}
+
+private:
+	static std::size_t index(std::uint64_t v)
+	{
+		if (v < SUB_NUM)
+			return static_cast<std::size_t>(v);
+
+		if (v >= (std::uint64_t(1) << (MAX_EXP + 1)))
+			return BUCKET_NUM - 1;
+
+		std::size_t exp = SUB_BITS;
+		while ((v >> (exp + 1)) != 0)
+			++exp;
+
+		return (exp - SUB_BITS + 1) * SUB_NUM + static_cast<std::size_t>((v >> (exp - SUB_BITS)) & (SUB_NUM - 1));
+	}
+
+	static std::uint64_t lowest(std::size_t i)
+	{
+		if (i < SUB_NUM)
+			return i;
+
+		const std::size_t exp = i / SUB_NUM + SUB_BITS - 1;
+		return (SUB_NUM + i % SUB_NUM) << (exp - SUB_BITS);
+	}
+
+	std::array<std::atomic<std::uint64_t>, BUCKET_NUM> buckets_;
+	std::atomic<std::uint64_t> max_;
+};
+
+//the counters of a handler. they are split into shards and a thread writes only to its own shard, so the threads
+//don't contend on a cache line, the shards are summed when the stats are read.
+class handler_stats
+{
+public:
+	enum { SHARD_NUM = 8, CODE_NUM = ARGUMENT_EXCEPTION + 1 };
+
+	void on_queued(std::uint64_t micros)
+	{
+		shards_[shard_index()].queue.record(micros);
+	}
+
+	void on_response(std::size_t bytes_in, const std::string& response, std::uint64_t micros)
+	{
+		shard& s = shards_[shard_index()];
+		s.calls.fetch_add(1, std::memory_order_relaxed);
+		s.bytes_in.fetch_add(bytes_in, std::memory_order_relaxed);
+		s.bytes_out.fetch_add(response.size(), std::memory_order_relaxed);
+		const int code = response_code(response);
+		if (code >= 0 && code < CODE_NUM)
+			s.codes[code].fetch_add(1, std::memory_order_relaxed);
+
+		s.exec.record(micros);
+	}
+
+	handler_stats_info info(const std::string& name) const
+	{
+		handler_stats_info info = { name, 0, std::vector<std::uint64_t>(CODE_NUM), 0, 0, {}, {} };
+		std::vector<std::uint64_t> queue, exec;
+		std::uint64_t queue_max = 0, exec_max = 0;
+		for (auto& s : shards_)
+		{
+			info.calls += s.calls.load(std::memory_order_relaxed);
+			info.bytes_in += s.bytes_in.load(std::memory_order_relaxed);
+			info.bytes_out += s.bytes_out.load(std::memory_order_relaxed);
+			for (std::size_t i = 0; i < CODE_NUM; i++)
+				info.codes[i] += s.codes[i].load(std::memory_order_relaxed);
+
+			s.queue.collect(queue, queue_max);
+			s.exec.collect(exec, exec_max);
+		}
+
+		info.queue = latency_histogram::percentiles(queue, queue_max);
+		info.exec = latency_histogram::percentiles(exec, exec_max);
+		return info;
+	}
+
+	//the result_code of a packed response_msg, -1 if it is not one.
+	static int response_code(const std::string& response)
+	{
+		if (response.compare(0, 8, "{\"code\":") == 0)
+			return response.size() > 8 && response[8] >= '0' && response[8] <= '9' ? response[8] - '0' : -1;
+
+		if (response.size() > 1 && response[0] == '\x92')
+			return static_cast<unsigned char>(response[1]);
+
+		return -1;
+	}
+
+private:
+	struct shard
+	{
+		shard() : calls(0), bytes_in(0), bytes_out(0)
+		{
+			for (auto& c : codes)
+				c = 0;
+		}
+
+		std::atomic<std::uint64_t> calls;
+		std::atomic<std::uint64_t> bytes_in;
+		std::atomic<std::uint64_t> bytes_out;
+		std::atomic<std::uint64_t> codes[CODE_NUM];
+		latency_histogram queue;
+		latency_histogram exec;
+	};
+
+	//the threads take the shards in turn.
+	static std::size_t shard_index()
+	{
+		static std::atomic<std::size_t> next(0);
+		static thread_local std::size_t index = next++ % SHARD_NUM;
+		return index;
+	}
+
+	std::array<shard, SHARD_NUM> shards_;
+};
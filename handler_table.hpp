@@ -0,0 +1,202 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+#include <boost/utility/string_ref.hpp>
+
+//FNV-1a, constexpr so a name can also be hashed at compile time.
+constexpr std::uint64_t hash_name(const char* name, std::size_t size)
+{
+	std::uint64_t h = 14695981039346656037ull;
+	for (std::size_t i = 0; i < size; i++)
+	{
+		h ^= static_cast<unsigned char>(name[i]);
+		h *= 1099511628211ull;
+	}
+
+	return h;
+}
+
+//a handler known at compile time, registered with router::register_handlers. the function is a template argument,
+//so it is called directly, and the hash of the name is computed by the compiler.
+template<std::uint64_t Hash, typename Function, Function Func>
+struct static_handler
+{
+	typedef Function function_type;
+	static constexpr std::uint64_t hash = Hash;
+
+	static constexpr Function function()
+	{
+		return Func;
+	}
+
+	const char* name;
+};
+
+//RPC_HANDLER("add", &add), the name is a string literal.
+#define RPC_HANDLER(name, func) static_handler<hash_name(name, sizeof(name) - 1), decltype(func), func>{ name }
+
+//a perfect hash of a set of name hashes found at compile time: slot() is different for every hash in the set.
+//the slots range over at least size^2 values, so a seed is found after a few tries.
+template<std::uint64_t... Hashes>
+struct perfect_hash
+{
+	enum { MAX_SEED = 4096 };
+
+	static constexpr std::size_t bits()
+	{
+		std::size_t b = 1;
+		while ((std::size_t(1) << b) < sizeof...(Hashes) * sizeof...(Hashes))
+			++b;
+
+		return b;
+	}
+
+	static constexpr std::size_t slot(std::uint64_t hash, std::uint64_t seed)
+	{
+		return static_cast<std::size_t>(((hash ^ seed) * 0x9e3779b97f4a7c15ull) >> (64 - bits()));
+	}
+
+	static constexpr bool distinct()
+	{
+		const std::uint64_t hashes[] = { Hashes... };
+		for (std::size_t i = 0; i < sizeof...(Hashes); i++)
+		{
+			for (std::size_t j = i + 1; j < sizeof...(Hashes); j++)
+			{
+				if (hashes[i] == hashes[j])
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	static constexpr bool is_perfect(std::uint64_t seed)
+	{
+		const std::uint64_t hashes[] = { Hashes... };
+		for (std::size_t i = 0; i < sizeof...(Hashes); i++)
+		{
+			for (std::size_t j = i + 1; j < sizeof...(Hashes); j++)
+			{
+				if (slot(hashes[i], seed) == slot(hashes[j], seed))
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	static constexpr std::uint64_t find_seed()
+	{
+		for (std::uint64_t seed = 0; seed < MAX_SEED; seed++)
+		{
+			if (is_perfect(seed))
+				return seed;
+		}
+
+		return MAX_SEED;
+	}
+};
+
+//an immutable hash table from handler names to T, updates build a new table.
+//it is looked up with a string_ref, so a name taken from the request needs no std::string.
+template<typename T>
+class handler_table
+{
+public:
+	struct entry
+	{
+		std::string name;
+		std::uint64_t hash;
+		T value;
+	};
+
+	handler_table() : mask_(0)
+	{
+	}
+
+	const entry* find(boost::string_ref name) const
+	{
+		if (slots_.empty())
+			return nullptr;
+
+		const std::uint64_t h = hash_name(name.data(), name.size());
+		for (std::size_t i = h & mask_; slots_[i] != 0; i = (i + 1) & mask_)
+		{
+			const entry& e = entries_[slots_[i] - 1];
+			if (e.hash == h && name == boost::string_ref(e.name))
+				return &e;
+		}
+
+		return nullptr;
+	}
+
+	//a copy with the handler added, or replaced if the name is there.
+	handler_table with(const std::string& name, T value) const
+	{
+		std::vector<entry> entries;
+		entries.reserve(entries_.size() + 1);
+		for (auto& e : entries_)
+		{
+			if (e.name != name)
+				entries.push_back(e);
+		}
+
+		entries.push_back({ name, hash_name(name.data(), name.size()), std::move(value) });
+		return handler_table(std::move(entries));
+	}
+
+	handler_table without(const std::string& name) const
+	{
+		std::vector<entry> entries;
+		entries.reserve(entries_.size());
+		for (auto& e : entries_)
+		{
+			if (e.name != name)
+				entries.push_back(e);
+		}
+
+		return handler_table(std::move(entries));
+	}
+
+	std::size_t size() const
+	{
+		return entries_.size();
+	}
+
+	template<typename F>
+	void for_each(F f) const
+	{
+		for (auto& e : entries_)
+			f(e);
+	}
+
+private:
+	//open addressing with linear probing, the slots hold the index of the entry plus one and stay at most half full.
+	explicit handler_table(std::vector<entry>&& entries) : entries_(std::move(entries)), mask_(0)
+	{
+		if (entries_.empty())
+			return;
+
+		std::size_t capacity = 4;
+		while (capacity < entries_.size() * 2)
+			capacity *= 2;
+
+		slots_.assign(capacity, 0);
+		mask_ = capacity - 1;
+		for (std::size_t n = 0; n < entries_.size(); n++)
+		{
+			std::size_t i = entries_[n].hash & mask_;
+			while (slots_[i] != 0)
+				i = (i + 1) & mask_;
+
+			slots_[i] = static_cast<std::uint32_t>(n + 1);
+		}
+	}
+
+	std::vector<entry> entries_;
+	std::vector<std::uint32_t> slots_;
+	std::size_t mask_;
+};
@@ -4,16 +4,23 @@
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 #include <stdexcept>
+#include <iostream>
+#include <cstring>
+#include "buffer_pool.hpp"
 #include <boost/thread/thread.hpp>
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 /// A pool of io_service objects.
 class io_service_pool
 	: private boost::noncopyable
 {
 public:
-	explicit io_service_pool(std::size_t pool_size) : next_io_service_(0)
+	explicit io_service_pool(std::size_t pool_size) : buffer_pools_(pool_size), next_io_service_(0), pin_threads_(false)
 	{
 		if (pool_size == 0)
 			throw std::runtime_error("io_service_pool size is 0");
@@ -34,11 +41,15 @@ public:
 
 	void run()
 	{
+		const std::vector<int> cpus = pin_threads_ ? allowed_cpus() : std::vector<int>();
 		std::vector<boost::shared_ptr<boost::thread> > threads;
 		for (std::size_t i = 0; i < io_services_.size(); ++i)
 		{
 			boost::shared_ptr<boost::thread> thread(new boost::thread(
 				boost::bind(&boost::asio::io_service::run, io_services_[i])));
+			if (!cpus.empty())
+				pin(*thread, cpus[i % cpus.size()]);
+
 			threads.push_back(thread);
 		}
 
@@ -52,6 +63,23 @@ public:
 			io_services_[i]->stop();
 	}
 
+	/// Run the thread of the i-th io_service on the i-th cpu the process may use, where the platform allows it.
+	/// Call it before run.
+	void set_pin_threads(bool pin_threads)
+	{
+		pin_threads_ = pin_threads;
+	}
+
+	std::size_t size() const
+	{
+		return io_services_.size();
+	}
+
+	boost::asio::io_service& get_io_service(std::size_t index)
+	{
+		return *io_services_[index];
+	}
+
 	boost::asio::io_service& get_io_service()
 	{
 		boost::asio::io_service& io_service = *io_services_[next_io_service_];
@@ -61,10 +89,57 @@ public:
 		return io_service;
 	}
 
+	/// The buffer pool which belongs to the io_service.
+	buffer_pool& get_buffer_pool(const boost::asio::io_service& io_service)
+	{
+		for (std::size_t i = 0; i < io_services_.size(); ++i)
+		{
+			if (io_services_[i].get() == &io_service)
+				return buffer_pools_[i];
+		}
+
+		throw std::invalid_argument("io_service is not in the pool");
+	}
+
 private:
+	/// The cpus in the affinity mask of the process, e.g. the ones of its cgroup or taskset. Empty where it is not known.
+	static std::vector<int> allowed_cpus()
+	{
+		std::vector<int> cpus;
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) != 0)
+			return cpus;
+
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		{
+			if (CPU_ISSET(cpu, &set))
+				cpus.push_back(cpu);
+		}
+#endif
+		return cpus;
+	}
+
+	/// A thread which can't be pinned keeps running on any cpu.
+	static void pin(boost::thread& thread, int cpu)
+	{
+#ifdef __linux__
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		const int err = pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+		if (err != 0)
+			std::cerr << "io_service_pool: can't pin a thread to cpu " << cpu << ": " << strerror(err) << std::endl;
+#endif
+	}
+
 	typedef boost::shared_ptr<boost::asio::io_service> io_service_ptr;
 	typedef boost::shared_ptr<boost::asio::io_service::work> work_ptr;
 
+	/// The receive buffers of the connections on each io_service, destroyed after the io_services.
+	std::vector<buffer_pool> buffer_pools_;
+
 	/// The pool of io_services.
 	std::vector<io_service_ptr> io_services_;
 
@@ -73,5 +148,8 @@ private:
 
 	/// The next io_service to use for a connection.
 	std::size_t next_io_service_;
+
+	/// Whether the threads are pinned to cores.
+	bool pin_threads_;
 };
 
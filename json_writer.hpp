@@ -0,0 +1,269 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <kapok/Kapok.hpp>
+#include <boost/lexical_cast.hpp>
+#include "bin_codec.hpp"
+#include "common.h"
+
+//appends json to a string the caller owns, so a buffer whose capacity is reused needs no allocation.
+//the output is the same as kapok's: a struct with META is an object, tuples and sequences are arrays.
+class json_writer
+{
+public:
+	explicit json_writer(std::string& buf) : buf_(buf)
+	{
+	}
+
+	void write_str(const char* str, std::size_t size)
+	{
+		buf_.push_back('"');
+		const char* run = str;
+		const char* end = str + size;
+		for (const char* p = str; p != end; ++p)
+		{
+			const unsigned char c = static_cast<unsigned char>(*p);
+			if (c >= 0x20 && c != '"' && c != '\\')
+				continue;
+
+			buf_.append(run, p);
+			run = p + 1;
+			escape(c);
+		}
+
+		buf_.append(run, end);
+		buf_.push_back('"');
+	}
+
+	//the text is json already, it is copied as it is.
+	void write_raw(const char* json, std::size_t size)
+	{
+		buf_.append(json, size);
+	}
+
+	//an empty raw_json is null, so the output stays json.
+	void write(const raw_json& raw)
+	{
+		if (raw.json.empty())
+			buf_.append("null");
+		else
+			write_raw(raw.json.data(), raw.json.size());
+	}
+
+	void write(bool b)
+	{
+		buf_.append(b ? "true" : "false");
+	}
+
+	void write(const std::string& str)
+	{
+		write_str(str.data(), str.size());
+	}
+
+	void write(const char* str)
+	{
+		write_str(str, strlen(str));
+	}
+
+	void write(char* str)
+	{
+		write_str(str, strlen(str));
+	}
+
+	template<typename T>
+	void write(const T& t)
+	{
+		write_value(t, kind<T>());
+	}
+
+private:
+	template<int N> struct kind_tag {};
+	enum { SIGNED_KIND, UNSIGNED_KIND, FLOAT_KIND, ENUM_KIND, META_KIND, MAP_KIND, SEQUENCE_KIND, TUPLE_KIND, OTHER_KIND };
+
+	template<typename T>
+	static auto kind()
+	{
+		return kind_tag<std::is_enum<T>::value ? ENUM_KIND : std::is_floating_point<T>::value ? FLOAT_KIND :
+			std::is_integral<T>::value ? (std::is_signed<T>::value ? SIGNED_KIND : UNSIGNED_KIND) : bin_has_meta<T>::value ? META_KIND :
+			bin_is_map<T>::value ? MAP_KIND : bin_is_sequence<T>::value ? SEQUENCE_KIND : bin_is_tuple<T>::value ? TUPLE_KIND : OTHER_KIND>();
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<SIGNED_KIND>)
+	{
+		const std::int64_t v = t;
+		if (v < 0)
+		{
+			buf_.push_back('-');
+			write_uint(0 - static_cast<std::uint64_t>(v));
+		}
+		else
+		{
+			write_uint(static_cast<std::uint64_t>(v));
+		}
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<UNSIGNED_KIND>)
+	{
+		write_uint(t);
+	}
+
+	//the shortest text which reads back as the same double, as rapidjson prints it.
+	template<typename T>
+	void write_value(const T& t, kind_tag<FLOAT_KIND>)
+	{
+		string_stream os(buf_);
+		rapidjson::Writer<string_stream> wr(os);
+		if (!wr.Double(static_cast<double>(t)))
+			buf_.append("null");
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<ENUM_KIND>)
+	{
+		write(static_cast<typename std::underlying_type<T>::type>(t));
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<META_KIND>)
+	{
+		auto meta = const_cast<T&>(t).Meta();
+		buf_.push_back('{');
+		write_fields(meta, std::make_index_sequence<std::tuple_size<decltype(meta)>::value>{});
+		buf_.push_back('}');
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<MAP_KIND>)
+	{
+		buf_.push_back('{');
+		bool first = true;
+		for (auto& pair : t)
+		{
+			if (!first)
+				buf_.push_back(',');
+
+			first = false;
+			write_key(pair.first);
+			buf_.push_back(':');
+			write(pair.second);
+		}
+
+		buf_.push_back('}');
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<SEQUENCE_KIND>)
+	{
+		buf_.push_back('[');
+		bool first = true;
+		for (auto& v : t)
+		{
+			if (!first)
+				buf_.push_back(',');
+
+			first = false;
+			write(v);
+		}
+
+		buf_.push_back(']');
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<TUPLE_KIND>)
+	{
+		buf_.push_back('[');
+		write_elements(t, std::make_index_sequence<std::tuple_size<T>::value>{});
+		buf_.push_back(']');
+	}
+
+	template<typename T>
+	void write_value(const T& t, kind_tag<OTHER_KIND>)
+	{
+		Serializer sr;
+		sr.Serialize(t);
+		buf_.append(sr.GetString());
+	}
+
+	template<typename Tuple, std::size_t... I>
+	void write_fields(Tuple& meta, std::index_sequence<I...>)
+	{
+		(void)std::initializer_list<int>{ ((I == 0 ? void() : buf_.push_back(',')), write(std::get<I>(meta).first), buf_.push_back(':'),
+			write(bin_unwrap(std::get<I>(meta).second)), 0)... };
+	}
+
+	template<typename Tuple, std::size_t... I>
+	void write_elements(const Tuple& t, std::index_sequence<I...>)
+	{
+		(void)std::initializer_list<int>{ ((I == 0 ? void() : buf_.push_back(',')), write(std::get<I>(t)), 0)... };
+	}
+
+	void write_key(const std::string& key)
+	{
+		write(key);
+	}
+
+	template<typename T>
+	void write_key(const T& key)
+	{
+		write(boost::lexical_cast<std::string>(key));
+	}
+
+	void write_uint(std::uint64_t v)
+	{
+		char digits[20];
+		char* p = digits + sizeof(digits);
+		do
+		{
+			*--p = static_cast<char>('0' + v % 10);
+			v /= 10;
+		} while (v != 0);
+
+		buf_.append(p, digits + sizeof(digits));
+	}
+
+	void escape(unsigned char c)
+	{
+		static const char hex[] = "0123456789abcdef";
+		switch (c)
+		{
+		case '"': buf_.append("\\\""); break;
+		case '\\': buf_.append("\\\\"); break;
+		case '\b': buf_.append("\\b"); break;
+		case '\f': buf_.append("\\f"); break;
+		case '\n': buf_.append("\\n"); break;
+		case '\r': buf_.append("\\r"); break;
+		case '\t': buf_.append("\\t"); break;
+		default:
+			buf_.append("\\u00");
+			buf_.push_back(hex[c >> 4]);
+			buf_.push_back(hex[c & 0xf]);
+			break;
+		}
+	}
+
+	//the output stream rapidjson writes the numbers to.
+	struct string_stream
+	{
+		typedef char Ch;
+
+		explicit string_stream(std::string& buf) : buf_(buf)
+		{
+		}
+
+		void Put(char c)
+		{
+			buf_.push_back(c);
+		}
+
+		void Flush()
+		{
+		}
+
+		std::string& buf_;
+	};
+
+	std::string& buf_;
+};
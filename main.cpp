@@ -98,22 +98,22 @@ TEST_CASE(rpc_qps, true)
 	server s(9000, std::thread::hardware_concurrency()); //if you fill the last param, the server will remove timeout connections. default never timeout.
 	s.register_handler("add", &add);;
 	s.register_handler("translate", &messenger::translate, &m);
-	s.register_handler("upload", &messenger::upload, &m);
+	s.register_handler("upload", &messenger::upload, &m, handler_options{ EXEC_POOL });
+	s.set_stats_dump(60);
 
 	s.run();
 
-	//client
-	//boost::asio::io_service ios;
-	//client_proxy client(ios);
-	//client.connect("xxx.xxx...", "9000");
-	//client.call(...);
+	//load it with client_proxy/loadgen, e.g. loadgen --connections 4 --outstanding 16 --duration 30
 	getchar();
 
 	std::uint64_t last_succeed_count = 0;
 
 	while (true)
 	{
-		auto curr_succeed_count = (std::uint64_t)g_succeed_count;
+		std::uint64_t curr_succeed_count = 0;
+		for (auto& info : router::get().stats())
+			curr_succeed_count += info.codes[OK];
+
 		std::cout << curr_succeed_count - last_succeed_count << std::endl;
 		last_succeed_count = curr_succeed_count;
 		std::this_thread::sleep_for(std::chrono::milliseconds(1000));
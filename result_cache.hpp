@@ -0,0 +1,131 @@
+#pragma once
+#include <string>
+#include <list>
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include "async_response.hpp"
+
+//the responses of an idempotent handler kept for ttl, keyed by the codec and the arguments of the call. a hit is copied
+//to the response without decoding the arguments or calling the handler, only the responses with result_code::OK are kept.
+//the cache is split into shards by the hash of the key, each has its own lock and evicts its least recently used entry.
+class result_cache
+{
+public:
+	result_cache(std::size_t capacity, std::chrono::milliseconds ttl) : shard_capacity_(capacity / SHARD_NUM + 1), ttl_(ttl)
+	{
+	}
+
+	template<typename Codec, typename Function>
+	void call(const Function& func, typename Codec::parser_type& parser, std::string& result, call_context& ctx)
+	{
+		std::string key;
+		Codec::append_key(key, parser.raw_args());
+		if (find(key, result))
+			return;
+
+		//a pooled or async handler answers later, the filler keeps the response then.
+		filler* f = new filler(this, std::move(key), ctx, &Codec::is_ok);
+		call_context fill_ctx = ctx;
+		fill_ctx.callback = &f->callback;
+		fill_ctx.stats = nullptr;
+		func(parser, result, fill_ctx);
+		if (!result.empty())
+		{
+			if (Codec::is_ok(result))
+				insert(f->key, result);
+
+			delete f;
+		}
+	}
+
+private:
+	enum { SHARD_NUM = 16 };
+	typedef std::chrono::steady_clock clock_type;
+
+	struct filler
+	{
+		typedef bool(*is_ok_type)(const std::string&);
+
+		filler(result_cache* cache, std::string&& key, const call_context& ctx, is_ok_type is_ok) : key(std::move(key)), ctx(ctx)
+		{
+			callback = [this, cache, is_ok](const std::string&, std::string&& result, std::shared_ptr<connection>, std::uint32_t, bool has_error)
+			{
+				if (is_ok(result))
+					cache->insert(this->key, result);
+
+				send_response(this->ctx, std::move(result), has_error);
+				delete this;
+			};
+		}
+
+		std::string key;
+		call_context ctx;
+		response_callback callback;
+	};
+
+	struct entry
+	{
+		std::string key;
+		std::string response;
+		clock_type::time_point expire;
+	};
+
+	struct shard
+	{
+		std::mutex mtx;
+		std::list<entry> lru;
+		std::unordered_map<std::string, std::list<entry>::iterator> index;
+	};
+
+	shard& shard_of(const std::string& key)
+	{
+		return shards_[std::hash<std::string>()(key) % SHARD_NUM];
+	}
+
+	bool find(const std::string& key, std::string& result)
+	{
+		shard& s = shard_of(key);
+		std::unique_lock<std::mutex> lock(s.mtx);
+		auto it = s.index.find(key);
+		if (it == s.index.end())
+			return false;
+
+		if (it->second->expire <= clock_type::now())
+		{
+			s.lru.erase(it->second);
+			s.index.erase(it);
+			return false;
+		}
+
+		s.lru.splice(s.lru.begin(), s.lru, it->second);
+		result.assign(it->second->response);
+		return true;
+	}
+
+	void insert(const std::string& key, const std::string& response)
+	{
+		shard& s = shard_of(key);
+		std::unique_lock<std::mutex> lock(s.mtx);
+		auto it = s.index.find(key);
+		if (it != s.index.end())
+		{
+			s.lru.erase(it->second);
+			s.index.erase(it);
+		}
+
+		s.lru.push_front({ key, response, clock_type::now() + ttl_ });
+		s.index.emplace(key, s.lru.begin());
+		while (s.lru.size() > shard_capacity_)
+		{
+			s.index.erase(s.lru.back().key);
+			s.lru.pop_back();
+		}
+	}
+
+	std::array<shard, SHARD_NUM> shards_;
+	const std::size_t shard_capacity_;
+	const std::chrono::milliseconds ttl_;
+};
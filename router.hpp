@@ -3,38 +3,189 @@
 #include <map>
 #include <string>
 #include <mutex>
+#include <atomic>
+#include <vector>
+#include <array>
+#include <thread>
 #include <memory>
+#include <chrono>
+#include <ostream>
+#include <algorithm>
 #include <boost/lexical_cast.hpp>
 #include <boost/noncopyable.hpp>
 #include "token_parser.hpp"
+#include "bin_codec.hpp"
+#include "buffer_pool.hpp"
+#include "handler_table.hpp"
+#include "async_response.hpp"
+#include "worker_pool.hpp"
+#include "singleflight.hpp"
+#include "result_cache.hpp"
+#include "tracer.hpp"
 #include "function_traits.hpp"
 #include "common.h"
 #include "utils.hpp"
 
 class connection;
 
+//how the arguments of a request are parsed and how the result is packed, one for each codec_type.
+struct json_codec
+{
+	typedef token_parser parser_type;
+
+	template<typename T>
+	static std::string pack(result_code code, const T& r)
+	{
+		return get_json(code, r);
+	}
+
+	template<typename T>
+	static void pack(std::string& buf, result_code code, const T& r)
+	{
+		trace_span span("serialize");
+		get_json(buf, code, r);
+	}
+
+	//the responses of the calls of a batch in an array.
+	static void pack_batch(std::string& buf, const std::vector<std::string>& results)
+	{
+		buf.push_back('[');
+		for (std::size_t i = 0; i < results.size(); i++)
+		{
+			if (i != 0)
+				buf.push_back(',');
+
+			buf.append(results[i]);
+		}
+
+		buf.push_back(']');
+	}
+
+	//the arguments of a singleflight call without the white spaces, so the same values give the same key.
+	static void append_key(std::string& key, boost::string_ref args)
+	{
+		key.push_back('j');
+		bool in_str = false;
+		for (std::size_t i = 0; i < args.size(); i++)
+		{
+			const char c = args[i];
+			if (in_str)
+			{
+				key.push_back(c);
+				if (c == '\\' && i + 1 < args.size())
+					key.push_back(args[++i]);
+				else if (c == '"')
+					in_str = false;
+			}
+			else if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+			{
+				in_str = c == '"';
+				key.push_back(c);
+			}
+		}
+	}
+
+	//a response_msg with the code 0, packed by get_json.
+	static bool is_ok(const std::string& response)
+	{
+		return response.compare(0, 10, "{\"code\":0,") == 0;
+	}
+};
+
+struct binary_codec
+{
+	typedef bin_parser parser_type;
+
+	template<typename T>
+	static std::string pack(result_code code, const T& r)
+	{
+		return get_bin(code, r);
+	}
+
+	template<typename T>
+	static void pack(std::string& buf, result_code code, const T& r)
+	{
+		trace_span span("serialize");
+		get_bin(buf, code, r);
+	}
+
+	static void pack_batch(std::string& buf, const std::vector<std::string>& results)
+	{
+		bin_writer wr(buf);
+		wr.write_array_head(results.size());
+		for (auto& r : results)
+			buf.append(r);
+	}
+
+	//an array of 2 followed by the code 0.
+	static bool is_ok(const std::string& response)
+	{
+		return response.size() > 2 && response[0] == '\x92' && response[1] == 0;
+	}
+
+	static void append_key(std::string& key, boost::string_ref args)
+	{
+		key.push_back('b');
+		key.append(args.data(), args.size());
+	}
+};
+
+//where a handler runs: on the io thread of the connection, or on the worker pool so a heavy handler doesn't delay
+//the cheap ones of the other connections on that thread. a pooled handler gets its arguments decoded on the io thread.
+enum exec_policy
+{
+	EXEC_INLINE = 0,
+	EXEC_POOL = 1
+};
+
+//the priority orders the calls waiting for the worker pool, an inline handler runs when its request is read,
+//so register_handler throws std::invalid_argument for a priority without EXEC_POOL.
+struct handler_options
+{
+	exec_policy exec = EXEC_INLINE;
+	task_priority priority = PRIORITY_NORMAL;
+	//for an idempotent handler: the same calls which come while it runs wait for it and get a copy of its response.
+	bool singleflight = false;
+	//for a pure handler: the response of a call is kept for cache_ttl_ms and the same calls are answered with it.
+	std::size_t cache_ttl_ms = 0;
+	std::size_t cache_capacity = 1024;
+};
+
 class invoker_function
 {
 public:
 	invoker_function() = default;
-	invoker_function(const std::function<void(token_parser &, std::string&)>& function, std::size_t size) : function_(function), param_size_(size)
+	invoker_function(const std::function<void(token_parser &, std::string&, call_context&)>& function,
+		const std::function<void(bin_parser &, std::string&, call_context&)>& bin_function) : function_(function), bin_function_(bin_function)
 	{
 
 	}
 
-	void operator()(token_parser &parser, std::string& result)
+	void operator()(token_parser &parser, std::string& result, call_context& ctx) const
+	{
+		function_(parser, result, ctx);
+	}
+
+	void operator()(bin_parser &parser, std::string& result, call_context& ctx) const
 	{
-		function_(parser, result);
+		bin_function_(parser, result, ctx);
 	}
 
-	const std::size_t param_size() const
+	//shared by the copies in the tables published after the handler was registered.
+	void set_stats(const std::shared_ptr<handler_stats>& stats)
 	{
-		return param_size_;
+		stats_ = stats;
+	}
+
+	handler_stats* stats() const
+	{
+		return stats_.get();
 	}
 
 private:
-	std::function<void(token_parser &, std::string& result)> function_;
-	std::size_t param_size_;
+	std::function<void(token_parser &, std::string& result, call_context&)> function_;
+	std::function<void(bin_parser &, std::string& result, call_context&)> bin_function_;
+	std::shared_ptr<handler_stats> stats_;
 };
 
 class router : boost::noncopyable
@@ -49,186 +200,779 @@ public:
 	template<typename Function>
 	void register_handler(std::string const & name, const Function& f) 
 	{
-		return register_nonmember_func(name, f);
+		return register_nonmember_func(name, f, default_options());
 	}
 
 	template<typename Function, typename Self>
 	void register_handler(std::string const & name, const Function& f, Self* self) 
 	{
-		return register_member_func(name, f, self);
+		return register_member_func(name, f, self, default_options());
+	}
+
+	template<typename Function>
+	void register_handler(std::string const & name, const Function& f, const handler_options& options)
+	{
+		check_options(options);
+		return register_nonmember_func(name, f, options);
+	}
+
+	template<typename Function, typename Self>
+	void register_handler(std::string const & name, const Function& f, Self* self, const handler_options& options)
+	{
+		check_options(options);
+		return register_member_func(name, f, self, options);
+	}
+
+	//the pool of the EXEC_POOL handlers, set it before they are registered. by default it has a thread for each core.
+	void set_worker_pool(std::size_t thread_num, std::size_t max_queued)
+	{
+		std::unique_lock<std::mutex> lock(update_mtx_);
+		if (workers_)
+			throw std::logic_error("the worker pool is created already");
+
+		workers_.reset(new worker_pool(thread_num, max_queued));
+	}
+
+	//the policy of the handlers registered without handler_options, set it before they are registered.
+	//with EXEC_POOL the io threads only read the requests and write the responses, the handlers are run by the
+	//work stealing pool, so the calls of a few busy connections don't queue up on one io thread.
+	void set_default_exec(exec_policy exec)
+	{
+		std::unique_lock<std::mutex> lock(update_mtx_);
+		default_exec_ = exec;
+	}
+
+	//registers a set of handlers known at compile time: RPC_HANDLER("add", &add), RPC_HANDLER("about", &hello).
+	//a name is looked up with a perfect hash found by the compiler and the handlers are called directly, the handlers
+	//registered at runtime are looked up after them. a call replaces the set registered before.
+	//they run inline on the io thread and have no handler_options, set_default_exec doesn't apply to them either.
+	//a handler which should run on the pool, be cached or be a singleflight is registered with register_handler.
+	template<typename... Handlers>
+	void register_handlers(Handlers... handlers)
+	{
+		static_assert(sizeof...(Handlers) > 0, "no handler");
+		static_assert(sizeof...(Handlers) < 0xffff, "too many handlers");
+		static_assert(perfect_hash<Handlers::hash...>::distinct(), "two handler names are the same or have the same hash");
+		static_assert(perfect_hash<Handlers::hash...>::find_seed() != perfect_hash<Handlers::hash...>::MAX_SEED, "no perfect hash for the names");
+
+		std::unique_lock<std::mutex> lock(update_mtx_);
+		static_table<Handlers...>::set_names(handlers...);
+		static_json_.store(&static_table<Handlers...>::template dispatch<json_codec>, std::memory_order_release);
+		static_bin_.store(&static_table<Handlers...>::template dispatch<binary_codec>, std::memory_order_release);
+		static_stats_.store(&static_table<Handlers...>::collect_stats, std::memory_order_release);
 	}
 
 	void remove_handler(std::string const& name) 
 	{
-		this->map_invokers_.erase(name);
+		update_table([&name](const table_type& table) { return table.without(name); });
 	}
 
-	void set_callback(const std::function<void(const std::string&, const char*, std::shared_ptr<connection>, bool)>& callback)
+	void set_callback(const response_callback& callback)
 	{
 		callback_to_server_ = callback;
 	}
 
+	//the stats of the handlers which have been called, the static ones first.
+	std::vector<handler_stats_info> stats()
+	{
+		std::vector<handler_stats_info> infos;
+		auto f = static_stats_.load(std::memory_order_acquire);
+		if (f != nullptr)
+			f(infos);
+
+		current_table()->for_each([&infos](const table_type::entry& e)
+		{
+			if (e.value.stats() != nullptr)
+				infos.push_back(e.value.stats()->info(e.name));
+		});
+
+		infos.erase(std::remove_if(infos.begin(), infos.end(), [](const handler_stats_info& info) { return info.calls == 0; }), infos.end());
+		return infos;
+	}
+
+	//a line for each handler, the latencies are in microseconds.
+	void dump_stats(std::ostream& os)
+	{
+		for (auto& info : stats())
+		{
+			os << info.name << ": calls " << info.calls << ", ok " << info.codes[OK] << ", fail " << info.codes[FAIL]
+				<< ", exception " << info.codes[EXCEPTION] << ", argument exception " << info.codes[ARGUMENT_EXCEPTION]
+				<< ", bytes in " << info.bytes_in << ", bytes out " << info.bytes_out
+				<< ", queue p50/p99/max " << info.queue.p50 << "/" << info.queue.p99 << "/" << info.queue.max
+				<< ", exec p50/p90/p99/max " << info.exec.p50 << "/" << info.exec.p90 << "/" << info.exec.p99 << "/" << info.exec.max << "\n";
+		}
+	}
+
 	template<typename T>
-	void route(const char* text, std::size_t length, T conn)
+	void route(const char* text, std::size_t length, std::uint32_t id, T conn)
 	{
-		token_parser parser;
-		parser.parse(text, length);
+		if (conn->codec() == BINARY_CODEC)
+			dispatch<binary_codec>(text, length, id, conn);
+		else
+			dispatch<json_codec>(text, length, id, conn);
+	}
 
-		while (!parser.empty())
+	router() : table_(std::make_shared<const table_type>()), static_json_(nullptr), static_bin_(nullptr), static_stats_(nullptr), default_exec_(EXEC_INLINE)
+	{
+	}
+private:
+	
+	router(const router&) = delete;
+	router(router&&) = delete;
+
+	template<typename Codec, typename T>
+	void dispatch(const char* text, std::size_t length, std::uint32_t id, T conn)
+	{
+		typename Codec::parser_type parser;
+		try
+		{
+			trace_span span("parse");
+			parser.parse(text, length);
+		}
+		catch (const std::exception& e)
+		{
+			callback_to_server_("", Codec::pack(result_code::ARGUMENT_EXCEPTION, std::string(e.what())), conn, id, true);
+			return;
+		}
+
+		//the arguments are checked while they are decoded, a request is one call.
+		if (!parser.empty())
 		{
-			std::string result = "";
-			std::string func_name = parser.get<std::string>();
+			boost::string_ref func_name = parser.read_name();
 
-			auto it = map_invokers_.find(func_name);
-			if (it == map_invokers_.end())
+			if (func_name == CODEC_HANDSHAKE)
 			{
-				result = get_json(result_code::ARGUMENT_EXCEPTION, "unknown function: " + func_name);
-				callback_to_server_(func_name, result.c_str(), conn, true);
+				negotiate_codec<Codec>(parser, id, conn);
 				return;
 			}
 
-			if (it->second.param_size() != parser.param_size()) //ƥ 
+			if (func_name == BATCH_CALL)
+			{
+				dispatch_batch<Codec>(parser, id, conn);
+				return;
+			}
+
+			if (func_name == STATS_CALL)
+			{
+				callback_to_server_(STATS_CALL, Codec::pack(result_code::OK, stats()), conn, id, false);
+				return;
+			}
+
+			call_context ctx = { &callback_to_server_, nullptr, std::move(conn), id, nullptr, {}, 0, 0, nullptr, nullptr };
+			call<Codec>(func_name, parser, ctx, length);
+			return;
+		}
+
+		//every request is answered, the connection counts it in flight until then.
+		callback_to_server_("", Codec::pack(result_code::ARGUMENT_EXCEPTION, std::string("no function is called")), conn, id, true);
+	}
+
+	//the result is given to the callback of the context, the handler is given the context to answer later.
+	template<typename Codec>
+	void call(boost::string_ref func_name, typename Codec::parser_type& parser, call_context& ctx, std::size_t length)
+	{
+		trace_span span("dispatch");
+		ctx.start = std::chrono::steady_clock::now();
+		ctx.bytes_in = length;
+		ctx.trace = tracer::current();
+		std::string result = string_pool::take();
+		if (!dispatch_static(func_name, parser, result, ctx))
+		{
+			std::shared_ptr<const table_type> table = current_table();
+			const table_type::entry* handler = table->find(func_name);
+			if (handler == nullptr)
 			{
-				result = get_json(result_code::ARGUMENT_EXCEPTION, std::string("parameter number is not match"));
-				callback_to_server_(func_name, result.c_str(), conn, true);
-				break;
+				Codec::pack(result, result_code::ARGUMENT_EXCEPTION, "unknown function: " + func_name.to_string());
+				(*ctx.callback)(func_name.to_string(), std::move(result), ctx.conn, ctx.id, true);
+				return;
 			}
 
+
 			//ҵfunctionУʼַתΪʵβ 
-			it->second(parser, result);
-			//response(result.c_str()); //callback to connection
-			if(callback_to_server_)
-				callback_to_server_(func_name, result.c_str(), conn, false);
+			ctx.name = &handler->name;
+			ctx.stats = handler->value.stats();
+			ctx.owner = std::move(table);
+			handler->value(parser, result, ctx);
 		}
+
+		//response(result.c_str()); //callback to connection
+		//an async handler leaves the result empty and answers through its async_response.
+		if (result.empty())
+			string_pool::give_back(std::move(result));
+		else if (*ctx.callback)
+			send_response(ctx, std::move(result));
 	}
 
-	router() = default;
-private:
-	
-	router(const router&) = delete;
-	router(router&&) = delete;
+	//the calls of a batch are made one after another on this thread, the pooled and async ones go on in parallel.
+	//each call answers the batch with its index as the id and the last answer sends the array of all of them.
+	template<typename Codec, typename T>
+	void dispatch_batch(typename Codec::parser_type& parser, std::uint32_t id, T conn)
+	{
+		std::vector<boost::string_ref> calls;
+		try
+		{
+			while (!parser.empty())
+				calls.push_back(parser.read_raw());
+		}
+		catch (const std::exception& e)
+		{
+			callback_to_server_(BATCH_CALL, Codec::pack(result_code::ARGUMENT_EXCEPTION, std::string(e.what())), conn, id, true);
+			return;
+		}
+
+		//the callback holds the batch and every context of a call holds the callback, so the batch goes away
+		//after the last answer has returned.
+		auto batch = std::make_shared<batch_call>(calls.size(), &callback_to_server_, conn, id, &Codec::pack_batch);
+		auto callback = std::make_shared<const response_callback>([batch](const std::string&, std::string&& result, std::shared_ptr<connection>, std::uint32_t index, bool)
+		{
+			batch->answer(index, std::move(result));
+		});
+
+		for (std::size_t i = 0; i < calls.size(); i++)
+		{
+			call_context ctx = { callback.get(), nullptr, conn, static_cast<std::uint32_t>(i), nullptr, {}, 0, 0, nullptr, callback };
+			typename Codec::parser_type call_parser;
+			boost::string_ref func_name;
+			try
+			{
+				call_parser.parse(calls[i].data(), calls[i].size());
+				func_name = call_parser.read_name();
+				if (func_name == BATCH_CALL || func_name == CODEC_HANDSHAKE)
+					throw std::invalid_argument(func_name.to_string() + " is not allowed in a batch");
+			}
+			catch (const std::exception& e)
+			{
+				batch->answer(ctx.id, Codec::pack(result_code::ARGUMENT_EXCEPTION, std::string(e.what())));
+				continue;
+			}
+
+			if (func_name == STATS_CALL)
+			{
+				batch->answer(ctx.id, Codec::pack(result_code::OK, stats()));
+				continue;
+			}
+
+			call<Codec>(func_name, call_parser, ctx, calls[i].size());
+		}
+
+		batch->done();
+	}
+
+	//collects the responses of the calls of a batch and sends them when all of them have answered.
+	class batch_call
+	{
+	public:
+		typedef void(*pack_type)(std::string&, const std::vector<std::string>&);
+
+		batch_call(std::size_t size, const response_callback* to_server, std::shared_ptr<connection> conn, std::uint32_t id, pack_type pack)
+			: results_(size), remaining_(size + 1), to_server_(to_server), conn_(std::move(conn)), id_(id), pack_(pack)
+		{
+		}
+
+		void answer(std::uint32_t index, std::string&& result)
+		{
+			results_[index] = std::move(result);
+			done();
+		}
+
+		//called once for each call and once when all the calls are made.
+		void done()
+		{
+			if (remaining_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+				return;
+
+			std::string buf = string_pool::take();
+			pack_(buf, results_);
+			for (auto& r : results_)
+				string_pool::give_back(std::move(r));
+
+			(*to_server_)(BATCH_CALL, std::move(buf), conn_, id_, false);
+		}
+
+	private:
+		std::vector<std::string> results_;
+		std::atomic<std::size_t> remaining_;
+		const response_callback* to_server_;
+		std::shared_ptr<connection> conn_;
+		std::uint32_t id_;
+		pack_type pack_;
+	};
+
+	//answered with the codec of the request, the new codec applies to the requests after it.
+	template<typename Codec, typename T>
+	void negotiate_codec(typename Codec::parser_type& parser, std::uint32_t id, T conn)
+	{
+		std::string name = parser.empty() ? std::string() : parser.template get<std::string>();
+		if (name != "json" && name != "binary")
+		{
+			callback_to_server_(CODEC_HANDSHAKE, Codec::pack(result_code::ARGUMENT_EXCEPTION, "unknown codec: " + name), conn, id, true);
+			return;
+		}
+
+		callback_to_server_(CODEC_HANDSHAKE, Codec::pack(result_code::OK, name), conn, id, false);
+		conn->set_codec(name == "binary" ? BINARY_CODEC : JSON_CODEC);
+	}
 
 	template<typename F, size_t... I, typename ... Args>
-	static auto call_helper(const F& f, const std::index_sequence<I...>&, const std::tuple<Args...>& tup)
+	static auto call_helper(const F& f, const std::index_sequence<I...>&, std::tuple<Args...>& tup)
 	{
-		return f(std::get<I>(tup)...);
+		return f(std::move(std::get<I>(tup))...);
 	}
 
-	template<typename F, typename ... Args>
-	static typename std::enable_if<std::is_void<typename std::result_of<F(Args...)>::type>::value>::type call(const F& f, std::string& result, const std::tuple<Args...>& tp)
+	template<typename Codec, typename F, typename ... Args>
+	static typename std::enable_if<std::is_void<typename std::result_of<F(Args...)>::type>::value>::type call(const F& f, std::string& result, std::tuple<Args...>& tp)
 	{
 		call_helper(f, std::make_index_sequence<sizeof... (Args)>{}, tp);
-		result = get_json(result_code::OK, 0);
+		Codec::pack(result, result_code::OK, 0);
 	}
 
-	template<typename F, typename ... Args>
-	static typename std::enable_if<!std::is_void<typename std::result_of<F(Args...)>::type>::value>::type call(const F& f, std::string& result, const std::tuple<Args...>& tp)
+	template<typename Codec, typename F, typename ... Args>
+	static typename std::enable_if<!std::is_void<typename std::result_of<F(Args...)>::type>::value>::type call(const F& f, std::string& result, std::tuple<Args...>& tp)
 	{
 		auto r = call_helper(f, std::make_index_sequence<sizeof... (Args)>{}, tp);
-		result = get_json(result_code::OK, r);
+		Codec::pack(result, result_code::OK, r);
 	}
 
 	template<typename F, typename Self, size_t... Indexes, typename ... Args>
-	static auto call_member_helper(const F& f, Self* self, const std::index_sequence<Indexes...>&, const std::tuple<Args...>& tup)
+	static auto call_member_helper(const F& f, Self* self, const std::index_sequence<Indexes...>&, std::tuple<Args...>& tup)
 	{
-		return (*self.*f)(std::get<Indexes>(tup)...);
+		return (*self.*f)(std::move(std::get<Indexes>(tup))...);
 	}
 
-	template<typename F, typename Self, typename ... Args>
+	template<typename Codec, typename F, typename Self, typename ... Args>
 	static typename std::enable_if<std::is_void<typename std::result_of<F(Self, Args...)>::type>::value>::type
-		call_member(const F& f, Self* self, std::string& result, const std::tuple<Args...>& tp)
+		call_member(const F& f, Self* self, std::string& result, std::tuple<Args...>& tp)
 	{
 		call_member_helper(f, self, typename std::make_index_sequence<sizeof... (Args)>{}, tp);
-		result = get_json(result_code::OK, 0);
+		Codec::pack(result, result_code::OK, 0);
 	}
 
-	template<typename F, typename Self, typename ... Args>
+	template<typename Codec, typename F, typename Self, typename ... Args>
 	static typename std::enable_if<!std::is_void<typename std::result_of<F(Self, Args...)>::type>::value>::type
-		call_member(const F& f, Self* self, std::string& result, const std::tuple<Args...>& tp)
+		call_member(const F& f, Self* self, std::string& result, std::tuple<Args...>& tp)
 	{
 		auto r = call_member_helper(f, self, typename std::make_index_sequence<sizeof... (Args)>{}, tp);
-		result = get_json(result_code::OK, r);
+		Codec::pack(result, result_code::OK, r);
 	}
 
-	//template<typename Function, class Signature = Function, size_t N = 0, size_t M = function_traits<Signature>::arity>
-	//struct invoker;
-
-	//functionʵַͣתΪʵβӵtuple
-	template<typename Function, size_t N = 0, size_t M = function_traits<Function>::arity>
+	//decode every argument straight into its element of the argument tuple, then call the function.
+	template<typename Function>
 	struct invoker
 	{
-		template<typename Args>
-		static inline void apply(const Function& func, token_parser & parser, std::string& result, Args const & args)
+		typedef typename function_traits<Function>::tuple_type tuple_type;
+
+		//the async_response of an async handler is made by the router, it is not an argument of the request.
+		enum { is_async = takes_async_response<Function>::value, arg_count = std::tuple_size<tuple_type>::value - is_async };
+
+		template<typename Codec>
+		static inline void apply(const Function& func, typename Codec::parser_type & parser, std::string& result, call_context& ctx)
 		{
-			typedef typename function_traits<Function>::template args<N>::type arg_type;
 			try
 			{
-				invoker<Function, N + 1, M>::apply(func, parser, result,
-					std::tuple_cat(args, std::make_tuple(parser.get<arg_type>())));
+				tuple_type args;
+				read_args(parser, args, std::make_index_sequence<arg_count>{});
+				if (!parser.empty())
+					throw std::invalid_argument("parameter number is not match");
+
+				invoke<Codec>(func, result, args, ctx, std::integral_constant<bool, is_async>{});
 			}
 			catch (std::invalid_argument& e)
 			{
-				result = get_json(result_code::ARGUMENT_EXCEPTION, e.what());
+				result.clear();
+				Codec::pack(result, result_code::ARGUMENT_EXCEPTION, e.what());
 			}
 			catch (std::exception& e)
 			{
-				result = get_json(result_code::EXCEPTION, e.what());
+				result.clear();
+				Codec::pack(result, result_code::EXCEPTION, e.what());
 			}
 		}
 
-		template<typename Args, typename Self>
-		static inline void apply_member(Function func, Self* self, token_parser & parser, std::string& result, const Args& args)
+		template<typename Codec, typename Self>
+		static inline void apply_member(Function func, Self* self, typename Codec::parser_type & parser, std::string& result, call_context& ctx)
 		{
-			typedef typename function_traits<Function>::template args<N>::type arg_type;
-
 			try
 			{
-				invoker<Function, N + 1, M>::apply_member(func, self, parser, result, std::tuple_cat(args, std::make_tuple(parser.get<arg_type>())));
+				tuple_type args;
+				read_args(parser, args, std::make_index_sequence<arg_count>{});
+				if (!parser.empty())
+					throw std::invalid_argument("parameter number is not match");
+
+				invoke_member<Codec>(func, self, result, args, ctx, std::integral_constant<bool, is_async>{});
 			}
 			catch (std::invalid_argument& e)
 			{
-				result = get_json(result_code::ARGUMENT_EXCEPTION, e.what());
+				result.clear();
+				Codec::pack(result, result_code::ARGUMENT_EXCEPTION, e.what());
 			}
 			catch (const std::exception& e)
 			{
-				result = get_json(result_code::EXCEPTION, e.what());
+				result.clear();
+				Codec::pack(result, result_code::EXCEPTION, e.what());
 			}
 		}
-	};
 
-	template<typename Function, size_t M>
-	struct invoker<Function, M, M>
-	{
-		template<typename Args>
-		static inline void apply(const Function& func, token_parser &, std::string& result, Args const & args)
+		template<typename Parser, size_t... I>
+		static inline void read_args(Parser& parser, tuple_type& args, const std::index_sequence<I...>&)
+		{
+			(void)std::initializer_list<int>{ (parser.read(std::get<I>(args)), 0)... };
+		}
+
+		template<typename Codec>
+		static inline void invoke(const Function& func, std::string& result, tuple_type& args, call_context&, std::false_type)
+		{
+			trace_span span("handler");
+			call<Codec>(func, result, args);
+		}
+
+		//the handler takes its response out of args, the copy here answers if the handler throws or drops it.
+		template<typename Codec>
+		static inline void invoke(const Function& func, std::string&, tuple_type& args, call_context& ctx, std::true_type)
+		{
+			trace_span span("handler");
+			auto response = make_async_response<Codec>(ctx);
+			std::get<arg_count>(args) = response;
+			try
+			{
+				call_helper(func, std::make_index_sequence<std::tuple_size<tuple_type>::value>{}, args);
+			}
+			catch (...)
+			{
+				if (response.take_answer())
+					throw;
+			}
+		}
+
+		template<typename Codec, typename Self>
+		static inline void invoke_member(Function func, Self* self, std::string& result, tuple_type& args, call_context&, std::false_type)
+		{
+			trace_span span("handler");
+			call_member<Codec>(func, self, result, args);
+		}
+
+		template<typename Codec, typename Self>
+		static inline void invoke_member(Function func, Self* self, std::string&, tuple_type& args, call_context& ctx, std::true_type)
+		{
+			trace_span span("handler");
+			auto response = make_async_response<Codec>(ctx);
+			std::get<arg_count>(args) = response;
+			try
+			{
+				call_member_helper(func, self, std::make_index_sequence<std::tuple_size<tuple_type>::value>{}, args);
+			}
+			catch (...)
+			{
+				if (response.take_answer())
+					throw;
+			}
+		}
+
+		template<typename Codec>
+		static auto make_async_response(const call_context& ctx)
 		{
-			//бѾ׼ãԵfunction
-			call(func, result, args);
+			typedef typename std::tuple_element<arg_count, tuple_type>::type response_type;
+			return response_type(ctx, &Codec::template pack<typename response_type::value_type>, &Codec::template pack<std::string>);
 		}
 
-		template<typename Args, typename Self>
-		static inline void apply_member(const Function& func, Self* self, token_parser &parser, std::string& result, const Args& args)
+		//the arguments are decoded here because the request buffer is reused once the io thread goes on,
+		//the handler runs and its result is packed on the pool, the result is sent back through the io_service of the connection.
+		template<typename Codec>
+		static inline void apply_pooled(worker_pool* pool, task_priority priority, const Function& func, typename Codec::parser_type & parser, std::string& result, call_context& ctx)
 		{
-			call_member(func, self, result, args);
+			try
+			{
+				tuple_type args;
+				read_args(parser, args, std::make_index_sequence<arg_count>{});
+				if (!parser.empty())
+					throw std::invalid_argument("parameter number is not match");
+
+				bool queued = pool->submit([func, args = std::move(args), ctx]() mutable
+				{
+					run_pooled<Codec>(ctx, [&](std::string& result) { invoke<Codec>(func, result, args, ctx, std::integral_constant<bool, is_async>{}); });
+				}, priority);
+
+				if (!queued)
+					throw std::runtime_error("the server is busy");
+			}
+			catch (std::invalid_argument& e)
+			{
+				result.clear();
+				Codec::pack(result, result_code::ARGUMENT_EXCEPTION, e.what());
+			}
+			catch (std::exception& e)
+			{
+				result.clear();
+				Codec::pack(result, result_code::EXCEPTION, e.what());
+			}
+		}
+
+		template<typename Codec, typename Self>
+		static inline void apply_member_pooled(worker_pool* pool, task_priority priority, Function func, Self* self, typename Codec::parser_type & parser, std::string& result, call_context& ctx)
+		{
+			try
+			{
+				tuple_type args;
+				read_args(parser, args, std::make_index_sequence<arg_count>{});
+				if (!parser.empty())
+					throw std::invalid_argument("parameter number is not match");
+
+				bool queued = pool->submit([func, self, args = std::move(args), ctx]() mutable
+				{
+					run_pooled<Codec>(ctx, [&](std::string& result) { invoke_member<Codec>(func, self, result, args, ctx, std::integral_constant<bool, is_async>{}); });
+				}, priority);
+
+				if (!queued)
+					throw std::runtime_error("the server is busy");
+			}
+			catch (std::invalid_argument& e)
+			{
+				result.clear();
+				Codec::pack(result, result_code::ARGUMENT_EXCEPTION, e.what());
+			}
+			catch (const std::exception& e)
+			{
+				result.clear();
+				Codec::pack(result, result_code::EXCEPTION, e.what());
+			}
+		}
+
+		template<typename Codec, typename Invoke>
+		static void run_pooled(call_context& ctx, Invoke&& invoke)
+		{
+			//the worker goes on with the trace of the request, its wait in the queue is a stage too.
+			trace_scope scope(ctx.trace);
+			if (ctx.trace != 0)
+				tracer::get().record("queue", ctx.trace, tracer::micros(ctx.start), tracer::now());
+
+			trace_span span("worker");
+			if (ctx.stats != nullptr)
+			{
+				ctx.stats->on_queued(micros_since(ctx.start));
+				ctx.start = std::chrono::steady_clock::now();
+			}
+
+			std::string result = string_pool::take();
+			try
+			{
+				invoke(result);
+			}
+			catch (const std::exception& e)
+			{
+				result.clear();
+				Codec::pack(result, result_code::EXCEPTION, e.what());
+			}
+
+			if (!result.empty())
+				send_response(ctx, std::move(result));
 		}
 	};
 
 	//עhandlermap
 	template<typename Function>
-	void register_nonmember_func(std::string const & name, const Function& f)
+	void register_nonmember_func(std::string const & name, const Function& f, const handler_options& options)
 	{
-		this->map_invokers_[name] = { std::bind(&invoker<Function>::template apply<std::tuple<>>, f,
-			std::placeholders::_1, std::placeholders::_2, std::tuple<>()), function_traits<Function>::arity };
+		using namespace std::placeholders;
+		invoker_function func;
+		if (options.exec == EXEC_POOL)
+		{
+			worker_pool* pool = get_worker_pool();
+			func = { std::bind(&invoker<Function>::template apply_pooled<json_codec>, pool, options.priority, f, _1, _2, _3),
+				std::bind(&invoker<Function>::template apply_pooled<binary_codec>, pool, options.priority, f, _1, _2, _3) };
+		}
+		else
+		{
+			func = { std::bind(&invoker<Function>::template apply<json_codec>, f, _1, _2, _3),
+				std::bind(&invoker<Function>::template apply<binary_codec>, f, _1, _2, _3) };
+		}
+
+		update_table([&](const table_type& table) { return table.with(name, wrap(func, options)); });
 	}
 
 	template<typename Function, typename Self>
-	void register_member_func(const std::string& name, const Function& f, Self* self)
+	void register_member_func(const std::string& name, const Function& f, Self* self, const handler_options& options)
 	{
-		this->map_invokers_[name] = { std::bind(&invoker<Function>::template apply_member<std::tuple<>, Self>, f, self, std::placeholders::_1,
-			std::placeholders::_2, std::tuple<>()), function_traits<Function>::arity };
+		using namespace std::placeholders;
+		invoker_function func;
+		if (options.exec == EXEC_POOL)
+		{
+			worker_pool* pool = get_worker_pool();
+			func = { std::bind(&invoker<Function>::template apply_member_pooled<json_codec, Self>, pool, options.priority, f, self, _1, _2, _3),
+				std::bind(&invoker<Function>::template apply_member_pooled<binary_codec, Self>, pool, options.priority, f, self, _1, _2, _3) };
+		}
+		else
+		{
+			func = { std::bind(&invoker<Function>::template apply_member<json_codec, Self>, f, self, _1, _2, _3),
+				std::bind(&invoker<Function>::template apply_member<binary_codec, Self>, f, self, _1, _2, _3) };
+		}
+
+		update_table([&](const table_type& table) { return table.with(name, wrap(func, options)); });
 	}
 
-	std::map<std::string, invoker_function> map_invokers_;
-	std::function<void(const std::string&, const char*, std::shared_ptr<connection>, bool)> callback_to_server_;
+	//a cache miss goes on to the singleflight group, so the same calls which miss together run once.
+	//the groups, caches and stats live as long as the handler, the old tables keep them after the handler is replaced.
+	static invoker_function wrap(invoker_function func, const handler_options& options)
+	{
+		if (options.singleflight)
+		{
+			auto group = std::make_shared<singleflight>();
+			func = { [group, func](token_parser& parser, std::string& result, call_context& ctx) { group->call<json_codec>(func, parser, result, ctx); },
+				[group, func](bin_parser& parser, std::string& result, call_context& ctx) { group->call<binary_codec>(func, parser, result, ctx); } };
+		}
+
+		if (options.cache_ttl_ms != 0)
+		{
+			auto cache = std::make_shared<result_cache>(options.cache_capacity, std::chrono::milliseconds(options.cache_ttl_ms));
+			func = { [cache, func](token_parser& parser, std::string& result, call_context& ctx) { cache->call<json_codec>(func, parser, result, ctx); },
+				[cache, func](bin_parser& parser, std::string& result, call_context& ctx) { cache->call<binary_codec>(func, parser, result, ctx); } };
+		}
+
+		func.set_stats(std::make_shared<handler_stats>());
+		return func;
+	}
+
+	//an inline handler runs as soon as its request is read, there is no queue its priority could order.
+	static void check_options(const handler_options& options)
+	{
+		if (options.exec != EXEC_POOL && options.priority != PRIORITY_NORMAL)
+			throw std::invalid_argument("a priority needs EXEC_POOL");
+	}
+
+	handler_options default_options()
+	{
+		std::unique_lock<std::mutex> lock(update_mtx_);
+		handler_options options;
+		options.exec = default_exec_;
+		return options;
+	}
+
+	worker_pool* get_worker_pool()
+	{
+		std::unique_lock<std::mutex> lock(update_mtx_);
+		if (!workers_)
+			workers_.reset(new worker_pool(std::thread::hardware_concurrency(), DEFAULT_MAX_QUEUED));
+
+		return workers_.get();
+	}
+
+	//the handlers of register_handlers. the compiler builds the table from the slots of the perfect hash to the handlers,
+	//so a name is hashed, its slot selects a handler and only the name of that one is compared.
+	template<typename... Handlers>
+	struct static_table
+	{
+		typedef perfect_hash<Handlers::hash...> hash_type;
+		typedef std::integral_constant<std::uint64_t, hash_type::find_seed()> seed_type;
+		enum { SLOT_NUM = std::size_t(1) << hash_type::bits() };
+
+		//the index + 1 of the handler in every slot, 0 in an empty one.
+		struct slot_array
+		{
+			std::uint16_t index[SLOT_NUM];
+		};
+
+		static constexpr slot_array make_slots()
+		{
+			slot_array slots = {};
+			const std::uint64_t hashes[] = { Handlers::hash... };
+			for (std::size_t i = 0; i < sizeof...(Handlers); i++)
+				slots.index[hash_type::slot(hashes[i], seed_type::value)] = static_cast<std::uint16_t>(i + 1);
+
+			return slots;
+		}
+
+		static std::array<std::string, sizeof...(Handlers)>& names()
+		{
+			static std::array<std::string, sizeof...(Handlers)> names;
+			return names;
+		}
+
+		//called under update_mtx_ before the dispatch of the set is published, only the first call writes the names,
+		//so dispatch never reads them while they are written. the hashes of the names are in the type of the set,
+		//a later call has the same names.
+		static void set_names(const Handlers&... handlers)
+		{
+			static bool named = false;
+			if (named)
+				return;
+
+			std::size_t i = 0;
+			(void)std::initializer_list<int>{ (names()[i++] = handlers.name, 0)... };
+			named = true;
+		}
+
+		static std::array<handler_stats, sizeof...(Handlers)>& stats()
+		{
+			static std::array<handler_stats, sizeof...(Handlers)> stats;
+			return stats;
+		}
+
+		static void collect_stats(std::vector<handler_stats_info>& infos)
+		{
+			for (std::size_t i = 0; i < sizeof...(Handlers); i++)
+				infos.push_back(stats()[i].info(names()[i]));
+		}
+
+		//false if there is no handler with the name, ctx.name is set to the name of the handler which was called.
+		template<typename Codec>
+		static bool dispatch(boost::string_ref name, typename Codec::parser_type& parser, std::string& result, call_context& ctx)
+		{
+			typedef void(*invoke_type)(typename Codec::parser_type&, std::string&, call_context&);
+			static constexpr slot_array slots = make_slots();
+			static constexpr invoke_type invokers[] = { &invoke<Codec, Handlers>... };
+
+			const std::size_t index = slots.index[hash_type::slot(hash_name(name.data(), name.size()), seed_type::value)];
+			if (index == 0 || name != boost::string_ref(names()[index - 1]))
+				return false;
+
+			ctx.name = &names()[index - 1];
+			ctx.stats = &stats()[index - 1];
+			invokers[index - 1](parser, result, ctx);
+			return true;
+		}
+
+		template<typename Codec, typename Handler>
+		static void invoke(typename Codec::parser_type& parser, std::string& result, call_context& ctx)
+		{
+			invoker<typename Handler::function_type>::template apply<Codec>(Handler::function(), parser, result, ctx);
+		}
+	};
+
+	bool dispatch_static(boost::string_ref name, token_parser& parser, std::string& result, call_context& ctx)
+	{
+		auto f = static_json_.load(std::memory_order_acquire);
+		return f != nullptr && f(name, parser, result, ctx);
+	}
+
+	bool dispatch_static(boost::string_ref name, bin_parser& parser, std::string& result, call_context& ctx)
+	{
+		auto f = static_bin_.load(std::memory_order_acquire);
+		return f != nullptr && f(name, parser, result, ctx);
+	}
+
+	typedef handler_table<invoker_function> table_type;
+
+	//an update publishes a new table, a call loads the current one once and holds it until it is answered (ctx.owner).
+	//a replaced table is freed when the last call which holds it is answered.
+	std::shared_ptr<const table_type> current_table() const
+	{
+		return std::atomic_load_explicit(&table_, std::memory_order_acquire);
+	}
+
+	template<typename F>
+	void update_table(F make_table)
+	{
+		std::unique_lock<std::mutex> lock(update_mtx_);
+		std::atomic_store_explicit(&table_, std::make_shared<const table_type>(make_table(*table_)), std::memory_order_release);
+	}
+
+	enum { DEFAULT_MAX_QUEUED = 4096 };
+
+	std::shared_ptr<const table_type> table_; //loaded and stored with std::atomic_load and std::atomic_store
+	std::mutex update_mtx_;
+	std::atomic<bool(*)(boost::string_ref, token_parser&, std::string&, call_context&)> static_json_;
+	std::atomic<bool(*)(boost::string_ref, bin_parser&, std::string&, call_context&)> static_bin_;
+	std::atomic<void(*)(std::vector<handler_stats_info>&)> static_stats_;
+	response_callback callback_to_server_;
+	std::unique_ptr<worker_pool> workers_;
+	exec_policy default_exec_;
 };
 
@@ -1,6 +1,8 @@
 #pragma once
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <iostream>
 
 #include "connection.hpp"
 #include "io_service_pool.hpp"
@@ -11,24 +13,102 @@ using boost::asio::ip::tcp;
 class server : private boost::noncopyable
 {
 public:
+	//the port is bound by run, after the mode of the acceptors is known.
 	server(short port, size_t size, size_t timeout_milli = 0) : io_service_pool_(size), timeout_milli_(timeout_milli),
-		acceptor_(io_service_pool_.get_io_service(), tcp::endpoint(tcp::v4(), port))
+		acceptor_(io_service_pool_.get_io_service()), endpoint_(tcp::v4(), port), max_in_flight_(1), max_frame_len_(MAX_FRAME_LEN),
+		stats_dump_seconds_(0), trace_flush_seconds_(0), trace_stop_(false), thread_per_core_(false)
 	{
 #ifdef PUB_SUB
 		register_handler("sub_timax", &server::sub, this);
 #endif
-		router::get().set_callback(std::bind(&server::callback, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
-		do_accept();
+		router::get().set_callback(std::bind(&server::callback, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5));
 	}
 
 	~server()
 	{
 		io_service_pool_.stop();
 		thd_->join();
+		if (trace_thd_)
+		{
+			{
+				std::unique_lock<std::mutex> lock(trace_mtx_);
+				trace_stop_ = true;
+			}
+
+			trace_cv_.notify_one();
+			trace_thd_->join();
+		}
+
+		if (!trace_path_.empty())
+			tracer::get().write_file(trace_path_);
+	}
+
+	//the requests a connection may have routed and not answered yet, at least 1. at the cap the connection stops
+	//reading until one of them is answered, so a client can't pile up pooled or async calls. more than 1 lets the
+	//EXEC_POOL and async handlers of a connection overlap, an inline handler still holds the io thread. call it before run.
+	void set_max_in_flight(std::size_t max_in_flight)
+	{
+		max_in_flight_ = max_in_flight;
+	}
+
+	//requests with a longer body are refused and their connection is closed. call it before run.
+	void set_max_frame_len(std::size_t max_frame_len)
+	{
+		max_frame_len_ = max_frame_len;
+	}
+
+	//writes the stats of the handlers to std::cout every stats_dump_seconds, they are also returned by a __stats call.
+	//call it before run.
+	void set_stats_dump(std::size_t stats_dump_seconds)
+	{
+		stats_dump_seconds_ = stats_dump_seconds;
+	}
+
+	//traces one in every sample_every requests of a connection thread and writes the stages of the latest ones to path
+	//as a chrome trace_event json file, every flush_seconds if it is not 0 and when the server is destroyed.
+	//call it before run.
+	void set_trace(std::size_t sample_every, const std::string& path, std::size_t flush_seconds = 0)
+	{
+		tracer::get().set_sample_every(sample_every);
+		trace_path_ = path;
+		trace_flush_seconds_ = flush_seconds;
+	}
+
+	//every thread of the pool gets its own acceptor on the port with SO_REUSEPORT and runs on its own core, the kernel
+	//spreads the new connections over the acceptors and a connection stays on the thread which accepted it, so accepting
+	//is not serialized on one thread and no connection crosses threads. the single acceptor is kept where SO_REUSEPORT
+	//is not available. call it before run.
+	void set_thread_per_core(bool thread_per_core)
+	{
+		thread_per_core_ = thread_per_core;
 	}
 
 	void run()
 	{
+		if (stats_dump_seconds_ != 0)
+		{
+			stats_timer_.reset(new boost::asio::deadline_timer(io_service_pool_.get_io_service()));
+			dump_stats();
+		}
+
+		if (!trace_path_.empty() && trace_flush_seconds_ != 0)
+			trace_thd_ = std::make_shared<std::thread>([this] { flush_trace(); });
+
+		if (thread_per_core_ && open_acceptors())
+		{
+			io_service_pool_.set_pin_threads(true);
+			for (std::size_t i = 0; i < acceptors_.size(); i++)
+				do_accept(*acceptors_[i], io_service_pool_.get_io_service(i));
+		}
+		else
+		{
+			acceptor_.open(endpoint_.protocol());
+			acceptor_.set_option(tcp::acceptor::reuse_address(true));
+			acceptor_.bind(endpoint_);
+			acceptor_.listen();
+			do_accept();
+		}
+
 		thd_ = std::make_shared<std::thread>([this] {io_service_pool_.run(); });
 	}
 
@@ -44,15 +124,71 @@ public:
 		router::get().register_handler(name, f, self);
 	}
 
+	template<typename Function>
+	void register_handler(std::string const & name, const Function& f, const handler_options& options)
+	{
+		router::get().register_handler(name, f, options);
+	}
+
+	template<typename Function, typename Self>
+	void register_handler(std::string const & name, const Function& f, Self* self, const handler_options& options)
+	{
+		router::get().register_handler(name, f, self, options);
+	}
+
+	//the threads of the handlers registered with EXEC_POOL and the most tasks waiting for them.
+	void set_worker_pool(std::size_t thread_num, std::size_t max_queued)
+	{
+		router::get().set_worker_pool(thread_num, max_queued);
+	}
+
+	//EXEC_POOL runs all the handlers registered without handler_options on the worker pool.
+	void set_default_exec(exec_policy exec)
+	{
+		router::get().set_default_exec(exec);
+	}
+
+	template<typename... Handlers>
+	void register_handlers(Handlers... handlers)
+	{
+		router::get().register_handlers(handlers...);
+	}
+
 	void remove_handler(std::string const& name) 
 	{
 		router::get().remove_handler(name);
 	}
 
 private:
+	void dump_stats()
+	{
+		stats_timer_->expires_from_now(boost::posix_time::seconds(stats_dump_seconds_));
+		stats_timer_->async_wait([this](boost::system::error_code ec)
+		{
+			if (ec)
+				return;
+
+			router::get().dump_stats(std::cout);
+			dump_stats();
+		});
+	}
+
+	//runs on its own thread, so writing the file doesn't hold up the connections of an io thread.
+	void flush_trace()
+	{
+		std::unique_lock<std::mutex> lock(trace_mtx_);
+		while (!trace_cv_.wait_for(lock, std::chrono::seconds(trace_flush_seconds_), [this] { return trace_stop_; }))
+		{
+			lock.unlock();
+			tracer::get().write_file(trace_path_);
+			lock.lock();
+		}
+	}
+
 	void do_accept()
 	{
-		conn_.reset(new connection(io_service_pool_.get_io_service(), timeout_milli_));
+		auto& io_service = io_service_pool_.get_io_service();
+		conn_.reset(new connection(io_service, io_service_pool_.get_buffer_pool(io_service), timeout_milli_, max_in_flight_, max_frame_len_));
 		acceptor_.async_accept(conn_->socket(), [this](boost::system::error_code ec)
 		{
 			if (ec)
@@ -68,6 +204,47 @@ private:
 		});
 	}
 
+	//the connection is made on the io_service of the acceptor.
+	void do_accept(tcp::acceptor& acceptor, boost::asio::io_service& io_service)
+	{
+		auto conn = std::make_shared<connection>(io_service, io_service_pool_.get_buffer_pool(io_service), timeout_milli_, max_in_flight_, max_frame_len_);
+		acceptor.async_accept(conn->socket(), [this, &acceptor, &io_service, conn](boost::system::error_code ec)
+		{
+			if (ec == boost::asio::error::operation_aborted)
+				return;
+
+			if (!ec)
+				conn->start();
+
+			do_accept(acceptor, io_service);
+		});
+	}
+
+	//an acceptor for each io_service, all bound to the endpoint. the port of the first one is taken by the others,
+	//so port 0 gives them one port chosen by the system.
+	bool open_acceptors()
+	{
+#ifdef SO_REUSEPORT
+		typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+		tcp::endpoint endpoint = endpoint_;
+		for (std::size_t i = 0; i < io_service_pool_.size(); i++)
+		{
+			std::unique_ptr<tcp::acceptor> acceptor(new tcp::acceptor(io_service_pool_.get_io_service(i)));
+			acceptor->open(endpoint.protocol());
+			acceptor->set_option(tcp::acceptor::reuse_address(true));
+			acceptor->set_option(reuse_port(true));
+			acceptor->bind(endpoint);
+			acceptor->listen();
+			endpoint = acceptor->local_endpoint();
+			acceptors_.push_back(std::move(acceptor));
+		}
+
+		return true;
+#else
+		return false;
+#endif
+	}
+
 private:
 	std::string sub(const std::string& topic)
 	{
@@ -93,7 +270,7 @@ private:
 				it = conn_map_.erase(it);
 			else
 			{
-				ptr->response(result.c_str());
+				ptr->push(result);
 				++it;
 			}
 		}
@@ -114,33 +291,35 @@ private:
 	}
 
 	//this callback from router, tell the server which connection sub the topic and the result of handler
-	void callback(const std::string& topic, const char* result, std::shared_ptr<connection> conn, bool has_error = false)
+	void callback(const std::string& topic, std::string&& result, std::shared_ptr<connection> conn, std::uint32_t id, bool has_error = false)
 	{
 #ifdef PUB_SUB
 		if (!has_error)
 		{
 			//log 
+			conn->no_response(id);
 			return;
 		}
 
 		if (topic == "sub_timax")
 		{
 			rapidjson::Document doc;
-			doc.Parse(result);
+			doc.Parse(result.c_str());
 			auto handler_name = doc["result"].GetString();
 			std::weak_ptr<connection> wp(conn);
 			conn_map_.emplace(handler_name, wp);
-			conn->response(result);
+			conn->response(id, std::move(result));
 			return;
 		}
 
 		if (!conn_map_.empty())
 		{
 			pub(topic, result);
-			conn->read_head();
 		}
+
+		conn->no_response(id);
 #else
-		conn->response(result);
+		conn->response(id, std::move(result));
 #endif
 	}
 
@@ -148,9 +327,22 @@ private:
 	std::multimap<std::string, std::weak_ptr<connection>> conn_map_;
 	io_service_pool io_service_pool_;
 	tcp::acceptor acceptor_;
+	std::vector<std::unique_ptr<tcp::acceptor>> acceptors_;
+	tcp::endpoint endpoint_;
 	std::shared_ptr<connection> conn_;
 	std::shared_ptr<std::thread> thd_;
 	std::size_t timeout_milli_;
+	std::size_t max_in_flight_;
+	std::size_t max_frame_len_;
+	std::size_t stats_dump_seconds_;
+	std::unique_ptr<boost::asio::deadline_timer> stats_timer_;
+	std::string trace_path_;
+	std::size_t trace_flush_seconds_;
+	std::shared_ptr<std::thread> trace_thd_;
+	std::mutex trace_mtx_;
+	std::condition_variable trace_cv_;
+	bool trace_stop_;
+	bool thread_per_core_;
 	std::mutex mtx_;
 };
 
@@ -0,0 +1,90 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include "async_response.hpp"
+#include "buffer_pool.hpp"
+
+//runs a handler once for the identical calls which come while it is running: the first call runs it and the others
+//wait, they all get a copy of its response. the calls are the same if their codec and arguments are.
+class singleflight
+{
+public:
+	template<typename Codec, typename Function>
+	void call(const Function& func, typename Codec::parser_type& parser, std::string& result, call_context& ctx)
+	{
+		std::string key;
+		Codec::append_key(key, parser.raw_args());
+
+		flight* f = join(std::move(key), ctx);
+		if (f == nullptr)
+			return;
+
+		call_context leader = ctx;
+		leader.callback = &f->callback;
+		leader.stats = nullptr;
+		func(parser, result, leader);
+		if (!result.empty())
+		{
+			f->callback(*ctx.name, std::move(result), ctx.conn, ctx.id, false);
+			result.clear();
+		}
+	}
+
+private:
+	//a running call and the calls waiting for it, it deletes itself when it is answered.
+	struct flight
+	{
+		flight(singleflight* group, const std::string& key, const call_context& leader) : group(group), key(key), leader(leader)
+		{
+			callback = [this](const std::string&, std::string&& result, std::shared_ptr<connection>, std::uint32_t, bool)
+			{
+				this->group->finish(this, std::move(result));
+			};
+		}
+
+		singleflight* group;
+		std::string key;
+		call_context leader;
+		std::vector<call_context> waiters;
+		response_callback callback;
+	};
+
+	//the flight to run, nullptr if the call waits for a running one.
+	flight* join(std::string&& key, const call_context& ctx)
+	{
+		std::unique_lock<std::mutex> lock(mtx_);
+		auto it = flights_.find(key);
+		if (it != flights_.end())
+		{
+			it->second->waiters.push_back(ctx);
+			return nullptr;
+		}
+
+		flight* f = new flight(this, key, ctx);
+		flights_.emplace(std::move(key), f);
+		return f;
+	}
+
+	void finish(flight* f, std::string&& result)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mtx_);
+			flights_.erase(f->key);
+		}
+
+		for (auto& w : f->waiters)
+		{
+			std::string copy = string_pool::take();
+			copy.assign(result);
+			send_response(w, std::move(copy));
+		}
+
+		send_response(f->leader, std::move(result));
+		delete f;
+	}
+
+	std::mutex mtx_;
+	std::unordered_map<std::string, flight*> flights_;
+};
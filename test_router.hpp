@@ -1,5 +1,20 @@
 #pragma once
+#include <atomic>
+#include <vector>
+#include <set>
+#include <clocale>
+#include <limits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "function_traits.hpp"
+#include "bin_codec.hpp"
+#include "json_writer.hpp"
+#include "token_parser.hpp"
+#include "handler_table.hpp"
+#include "worker_pool.hpp"
+#include "router.hpp"
+#include "connection.hpp"
 #define TEST_MAIN
 #include "unit_test.hpp"
 
@@ -13,3 +28,795 @@ TEST_CASE(function_traits_on_normal_function)
 	TEST_CHECK(function_traits<decltype(test_func)>::arity == 2);
 }
 
+
+TEST_CASE(bin_codec_round_trip)
+{
+	std::string buf;
+	bin_writer wr(buf);
+	wr.write_map_head(1);
+	wr.write("add");
+	wr.write_array_head(3);
+	wr.write(-70000);
+	wr.write(std::string(40, 'x'));
+	wr.write(std::vector<double>{ 1.5, -2 });
+
+	bin_parser parser;
+	parser.parse(buf.data(), buf.size());
+	TEST_CHECK(parser.get<std::string>() == "add");
+	TEST_CHECK(parser.param_size() == 3);
+	TEST_CHECK(parser.get<int>() == -70000);
+	TEST_CHECK(parser.get<std::string>() == std::string(40, 'x'));
+	TEST_CHECK((parser.get<std::vector<double>>() == std::vector<double>{ 1.5, -2 }));
+	TEST_CHECK(parser.empty());
+}
+
+//a request with the argument arg, true if reading it as a T is refused.
+template<typename T, typename Arg>
+bool bin_argument_refused(const Arg& arg)
+{
+	std::string buf;
+	bin_writer wr(buf);
+	wr.write_map_head(1);
+	wr.write("f");
+	wr.write_array_head(1);
+	wr.write(arg);
+
+	bin_parser parser;
+	parser.parse(buf.data(), buf.size());
+	parser.read_name();
+	try
+	{
+		parser.get<T>();
+	}
+	catch (const std::invalid_argument&)
+	{
+		return true;
+	}
+
+	return false;
+}
+
+TEST_CASE(bin_parser_checks_numbers)
+{
+	//what the json codec refuses too: out of the range of the parameter, a float for an integer.
+	TEST_CHECK(bin_argument_refused<int>(std::numeric_limits<std::uint64_t>::max()));
+	TEST_CHECK(bin_argument_refused<int>(std::int64_t(1) << 31));
+	TEST_CHECK(bin_argument_refused<unsigned>(-1));
+	TEST_CHECK(bin_argument_refused<std::uint8_t>(256));
+	TEST_CHECK(bin_argument_refused<std::int8_t>(-129));
+	TEST_CHECK(bin_argument_refused<int>(1.5));
+	TEST_CHECK(bin_argument_refused<bool>(1));
+	TEST_CHECK(!bin_argument_refused<std::int8_t>(-128));
+	TEST_CHECK(!bin_argument_refused<std::int64_t>(std::numeric_limits<std::int64_t>::min()));
+	TEST_CHECK(!bin_argument_refused<std::uint64_t>(std::numeric_limits<std::uint64_t>::max()));
+	TEST_CHECK(!bin_argument_refused<double>(-3));
+
+	std::string buf;
+	bin_writer wr(buf);
+	wr.write_map_head(1);
+	wr.write("f");
+	wr.write_array_head(1);
+	wr.write(-129);
+	bin_parser parser;
+	parser.parse(buf.data(), buf.size());
+	parser.read_name();
+	TEST_CHECK(parser.get<std::int16_t>() == -129);
+}
+
+TEST_CASE(bin_parser_rejects_trailing_bytes)
+{
+	std::string buf;
+	bin_writer wr(buf);
+	wr.write_map_head(1);
+	wr.write("f");
+	wr.write_array_head(1);
+	wr.write(1);
+	buf.push_back('\x01');
+
+	bin_parser parser;
+	parser.parse(buf.data(), buf.size());
+	parser.read_name();
+	bool thrown = false;
+	try
+	{
+		parser.get<int>();
+	}
+	catch (const std::invalid_argument&)
+	{
+		thrown = true;
+	}
+
+	TEST_CHECK(thrown);
+
+	//a call without arguments ends right after its empty array.
+	buf.clear();
+	wr.write_map_head(1);
+	wr.write("f");
+	wr.write_array_head(0);
+	buf.push_back('\xc0');
+	thrown = false;
+	try
+	{
+		parser.parse(buf.data(), buf.size());
+	}
+	catch (const std::invalid_argument&)
+	{
+		thrown = true;
+	}
+
+	TEST_CHECK(thrown);
+}
+
+TEST_CASE(bin_reader_limits_nesting)
+{
+	std::string buf;
+	bin_writer wr(buf);
+	wr.write_map_head(1);
+	wr.write("__batch");
+	wr.write_array_head(1);
+	buf.append(100000, '\x91');
+	buf.push_back('\xc0');
+
+	bin_parser parser;
+	parser.parse(buf.data(), buf.size());
+	TEST_CHECK(parser.read_name() == "__batch");
+	bool thrown = false;
+	try
+	{
+		parser.read_raw();
+	}
+	catch (const std::invalid_argument&)
+	{
+		thrown = true;
+	}
+
+	TEST_CHECK(thrown);
+}
+
+struct test_point
+{
+	int x;
+	std::string tag;
+	META(x, tag);
+};
+
+TEST_CASE(token_parser_decodes_while_scanning)
+{
+	std::string json = "{\"move\": [{\"extra\": {\"a\": [1, \"]\"]}, \"tag\": \"p\\u00e9\", \"x\": -3}, [2.5, 1e2], \"\"]}";
+
+	token_parser parser;
+	parser.parse(json.data(), json.size());
+	TEST_CHECK(parser.param_size() == 4);
+	TEST_CHECK(parser.get<std::string>() == "move");
+	test_point pt = parser.get<test_point>();
+	TEST_CHECK(pt.x == -3 && pt.tag == "p\xc3\xa9");
+	TEST_CHECK((parser.get<std::vector<double>>() == std::vector<double>{ 2.5, 100 }));
+	TEST_CHECK(parser.get<std::string>().empty());
+	TEST_CHECK(parser.empty());
+}
+
+TEST_CASE(token_parser_splits_batch)
+{
+	std::string json = "{\"__batch\": [{\"add\": [1, 2]}, {\"about\": \"\"}]}";
+
+	token_parser parser;
+	parser.parse(json.data(), json.size());
+	TEST_CHECK(parser.read_name() == "__batch");
+	TEST_CHECK(parser.read_raw() == "{\"add\": [1, 2]}");
+	boost::string_ref call = parser.read_raw();
+	TEST_CHECK(parser.empty());
+
+	token_parser call_parser;
+	call_parser.parse(call.data(), call.size());
+	TEST_CHECK(call_parser.read_name() == "about");
+	TEST_CHECK(call_parser.empty());
+}
+
+TEST_CASE(token_parser_reads_empty_string_argument)
+{
+	//what client.call("echo", std::string()) sends, a handler without parameters takes it as no argument.
+	std::string json = "{\"echo\":\"\"}";
+
+	token_parser parser;
+	parser.parse(json.data(), json.size());
+	TEST_CHECK(parser.read_name() == "echo");
+	TEST_CHECK(parser.empty());
+	TEST_CHECK(parser.get<std::string>().empty());
+	TEST_CHECK(parser.empty());
+}
+
+TEST_CASE(token_parser_rejects_invalid_json)
+{
+	//the arguments are read as strings, a value which is not a string is checked while it is skipped.
+	const char* requests[] = { "{\"f\":[1]} x", "{\"f\":[1]}}", "{\"f\":1,}", "{\"f\":[]}]", "{\"f\":[01]}", "{\"f\":[-01.5]}",
+		"{\"f\":[1.]}", "{\"f\":[.5]}", "{\"f\":[1e]}", "{\"f\":[+1]}", "{\"f\":[[1,2-3]]}", "{\"f\":[\"\\x\"]}", "{\"f\":[{\"\\q\":1}]}", "{\"f\":[\"\\u12g4\"]}" };
+	for (const char* json : requests)
+	{
+		bool thrown = false;
+		try
+		{
+			token_parser parser;
+			parser.parse(json, strlen(json));
+			parser.read_name();
+			while (!parser.empty())
+				parser.get<std::string>();
+		}
+		catch (const std::invalid_argument&)
+		{
+			thrown = true;
+		}
+
+		TEST_CHECK(thrown);
+	}
+
+	std::string json = "{\"f\":[01]}";
+	token_parser parser;
+	parser.parse(json.data(), json.size());
+	parser.read_name();
+	bool thrown = false;
+	try
+	{
+		parser.get<int>();
+	}
+	catch (const std::invalid_argument&)
+	{
+		thrown = true;
+	}
+
+	TEST_CHECK(thrown);
+}
+
+TEST_CASE(token_parser_reads_numbers_in_any_locale)
+{
+	//a locale whose decimal point is a comma, if there is one.
+	const std::string old_locale = setlocale(LC_NUMERIC, nullptr);
+	setlocale(LC_NUMERIC, "de_DE.UTF-8");
+	std::string json = "{\"f\":[2.5, -0.125e1, 1e-300, 0.1, 12345678901234567890.5]}";
+	token_parser parser;
+	parser.parse(json.data(), json.size());
+	parser.read_name();
+	TEST_CHECK(parser.get<double>() == 2.5);
+	TEST_CHECK(parser.get<double>() == -1.25);
+	TEST_CHECK(parser.get<double>() == 1e-300);
+	TEST_CHECK(parser.get<double>() == 0.1);
+	TEST_CHECK(parser.get<double>() == 12345678901234567890.5);
+	TEST_CHECK(parser.empty());
+	setlocale(LC_NUMERIC, old_locale.c_str());
+}
+
+TEST_CASE(json_writer_escapes_strings)
+{
+	std::string text;
+	for (int c = 0; c < 0x20; c++)
+		text.push_back(static_cast<char>(c));
+
+	text += "\"\\/\x7fp\xc3\xa9";
+	std::string json;
+	json_writer wr(json);
+	wr.write(text);
+	bool escaped = true;
+	for (char c : json)
+		escaped = escaped && static_cast<unsigned char>(c) >= 0x20;
+
+	TEST_CHECK(escaped);
+	TEST_CHECK(json.compare(0, 9, "\"\\u0000\\u") == 0);
+	TEST_CHECK(json.find("\\b\\t\\n\\u000b\\f\\r") != std::string::npos);
+
+	rapidjson::Document doc;
+	doc.Parse(json.data(), json.size());
+	TEST_CHECK(!doc.HasParseError() && doc.IsString());
+	TEST_CHECK(std::string(doc.GetString(), doc.GetStringLength()) == text);
+}
+
+TEST_CASE(json_writer_splices_raw_json)
+{
+	std::vector<raw_json> results = { { "{\"a\":[1,\"]\"]}" }, {} };
+	const std::string json = get_json(result_code::OK, results);
+	TEST_CHECK(json == "{\"code\":0,\"result\":[{\"a\":[1,\"]\"]},null]}");
+
+	rapidjson::Document doc;
+	doc.Parse(json.data(), json.size());
+	TEST_CHECK(!doc.HasParseError() && doc["result"].IsArray() && doc["result"].Size() == 2);
+	const rapidjson::Value& spliced = doc["result"][0u];
+	TEST_CHECK(spliced.IsObject() && spliced["a"].Size() == 2 && spliced["a"][1u].GetString() == std::string("]"));
+	TEST_CHECK(doc["result"][1u].IsNull());
+}
+
+TEST_CASE(json_writer_writes_floats)
+{
+	//every double reads back as the same value, one which isn't a number is null.
+	const std::vector<double> values = { 0.1, -2.5, 1.0 / 3, 100, 1e300, -5e-324, 0 };
+	std::string json;
+	json_writer wr(json);
+	wr.write(values);
+
+	//read back at full precision, so a difference is the writer's.
+	rapidjson::Document doc;
+	doc.Parse<rapidjson::kParseFullPrecisionFlag>(json.c_str());
+	TEST_CHECK(!doc.HasParseError() && doc.IsArray() && doc.Size() == values.size());
+	bool same = true;
+	for (rapidjson::SizeType i = 0; i < values.size(); i++)
+		same = same && doc[i].IsNumber() && doc[i].GetDouble() == values[i];
+
+	TEST_CHECK(same);
+
+	json.clear();
+	wr.write(std::make_tuple(0.1f, std::numeric_limits<double>::quiet_NaN(), std::numeric_limits<double>::infinity()));
+	doc.Parse<rapidjson::kParseFullPrecisionFlag>(json.c_str());
+	TEST_CHECK(!doc.HasParseError() && doc.IsArray() && doc.Size() == 3);
+	TEST_CHECK(doc[0u].GetDouble() == static_cast<double>(0.1f) && doc[1u].IsNull() && doc[2u].IsNull());
+}
+
+TEST_CASE(handler_table_update)
+{
+	handler_table<int> table;
+	for (int i = 0; i < 100; i++)
+		table = table.with("handler" + std::to_string(i), i);
+
+	table = table.with("handler7", 700).without("handler8");
+	TEST_CHECK(table.size() == 99);
+	TEST_CHECK(table.find("handler7")->value == 700);
+	TEST_CHECK(table.find("handler99")->value == 99);
+	TEST_CHECK(table.find("handler8") == nullptr);
+	TEST_CHECK(table.find("handler") == nullptr);
+}
+
+//a pooled handler which holds its calls until they are released, so they stay in flight.
+struct held_calls
+{
+	int hold()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		++started;
+		cv.notify_all();
+		cv.wait(lock, [this] { return released; });
+		return started;
+	}
+
+	int wait_started(int n)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		cv.wait_for(lock, std::chrono::seconds(5), [this, n] { return started >= n; });
+		return started;
+	}
+
+	void release()
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		released = true;
+		cv.notify_all();
+	}
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	int started = 0;
+	bool released = false;
+};
+
+TEST_CASE(worker_pool_runs_every_task_once)
+{
+	const int submitters = 4, tasks = 1000;
+	std::vector<std::atomic<int>> runs(submitters * tasks);
+	for (auto& n : runs)
+		n = 0;
+
+	std::atomic<int> refused(0);
+	{
+		worker_pool pool(4, submitters * tasks);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < submitters; t++)
+		{
+			threads.emplace_back([&pool, &runs, &refused, t]
+			{
+				for (int i = 0; i < tasks; i++)
+				{
+					std::atomic<int>& n = runs[t * tasks + i];
+					if (!pool.submit([&n] { ++n; }, static_cast<task_priority>(i % PRIORITY_NUM)))
+						++refused;
+				}
+			});
+		}
+
+		for (auto& t : threads)
+			t.join();
+
+		pool.stop();
+	}
+
+	TEST_CHECK(refused == 0);
+	bool once = true;
+	for (auto& n : runs)
+		once = once && n == 1;
+
+	TEST_CHECK(once);
+}
+
+TEST_CASE(worker_pool_refuses_when_full)
+{
+	//the only thread is held, so the tasks stay queued.
+	held_calls held;
+	std::atomic<int> ran(0);
+	worker_pool pool(1, 2);
+	TEST_CHECK(pool.submit([&held] { held.hold(); }));
+	TEST_CHECK(held.wait_started(1) == 1);
+
+	TEST_CHECK(pool.submit([&ran] { ++ran; }));
+	TEST_CHECK(pool.submit([&ran] { ++ran; }));
+	TEST_CHECK(!pool.submit([&ran] { ++ran; }));
+	//every priority has its own bound.
+	TEST_CHECK(pool.submit([&ran] { ++ran; }, PRIORITY_HIGH));
+
+	held.release();
+	pool.stop();
+	TEST_CHECK(ran == 3);
+	TEST_CHECK(!pool.submit([&ran] { ++ran; }));
+}
+
+TEST_CASE(worker_pool_takes_priorities_by_turns)
+{
+	held_calls held;
+	std::string order;
+	worker_pool pool(1, 16);
+	TEST_CHECK(pool.submit([&held] { held.hold(); }, PRIORITY_HIGH));
+	TEST_CHECK(held.wait_started(1) == 1);
+
+	const char names[] = "HNL";
+	const int counts[] = { 16, 8, 2 };
+	for (int p = PRIORITY_LOW; p >= PRIORITY_HIGH; --p)
+	{
+		for (int i = 0; i < counts[p]; i++)
+			TEST_CHECK(pool.submit([&order, &names, p] { order += names[p]; }, static_cast<task_priority>(p)));
+	}
+
+	held.release();
+	pool.stop();
+	//8 high, 4 normal and 1 low out of 13 turns, the held task has used the first high turn.
+	TEST_CHECK(order == "HHHHHHHNNNNLHHHHHHHHNNNNLH");
+}
+
+TEST_CASE(connection_stops_reading_at_max_in_flight)
+{
+	//more threads than the cap, so the calls held are the ones read. the pool may be made already, by default it has
+	//a thread for each core.
+	router& r = router::get();
+	try
+	{
+		r.set_worker_pool(4, 1024);
+	}
+	catch (const std::logic_error&)
+	{
+	}
+
+	held_calls held;
+	handler_options options;
+	options.exec = EXEC_POOL;
+	r.register_handler("test_hold", &held_calls::hold, &held, options);
+	r.set_callback([](const std::string&, std::string&& result, std::shared_ptr<connection> conn, std::uint32_t id, bool)
+	{
+		conn->response(id, std::move(result));
+	});
+
+	boost::asio::io_service io_service;
+	buffer_pool pool;
+	tcp::acceptor acceptor(io_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+	tcp::socket client(io_service);
+	client.connect(acceptor.local_endpoint());
+	auto conn = std::make_shared<connection>(io_service, pool, 0, 2);
+	acceptor.accept(conn->socket());
+
+	//5 calls in one write, with a cap of 2 the third one stays unread until a call is answered.
+	std::string frames;
+	const std::string body = "{\"test_hold\":[]}";
+	for (std::uint32_t id = 1; id <= 5; id++)
+	{
+		msg_head head = { static_cast<std::uint32_t>(body.size()), id };
+		frames.append((const char*)&head, sizeof(msg_head));
+		frames.append(body);
+	}
+
+	boost::asio::write(client, boost::asio::buffer(frames));
+	conn->start();
+	//a paused connection has no operation pending, the work keeps the thread for the answers.
+	boost::asio::io_service::work work(io_service);
+	std::thread io_thread([&io_service] { io_service.run(); });
+	TEST_CHECK(held.wait_started(2) == 2);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	TEST_CHECK(held.wait_started(0) == 2);
+
+	held.release();
+	std::set<std::uint32_t> ids;
+	for (int i = 0; i < 5; i++)
+	{
+		msg_head head;
+		boost::asio::read(client, boost::asio::buffer(&head, sizeof(msg_head)));
+		std::string result(head.len, '\0');
+		boost::asio::read(client, boost::asio::buffer(&result[0], result.size()));
+		ids.insert(head.id);
+	}
+
+	TEST_CHECK(ids.size() == 5 && held.wait_started(0) == 5);
+	r.remove_handler("test_hold");
+	io_service.stop();
+	io_thread.join();
+}
+
+TEST_CASE(router_batch_answers_after_its_calls)
+{
+	//the last call of the batch is answered on another thread after the batch is dispatched.
+	static std::vector<async_response<int>> pending;
+	static std::vector<std::string> responses;
+	router& r = router::get();
+	r.register_handler("test_later", [](int, async_response<int> response)
+	{
+		pending.push_back(response);
+	});
+	r.set_callback([](const std::string&, std::string&& result, std::shared_ptr<connection>, std::uint32_t, bool)
+	{
+		responses.push_back(std::move(result));
+	});
+
+	boost::asio::io_service io_service;
+	buffer_pool pool;
+	auto conn = std::make_shared<connection>(io_service, pool, 0);
+	const std::string request = "{\"__batch\":[{\"test_later\":[1]},{\"__stats\":\"\"},{\"__batch\":[]}]}";
+	r.route(request.data(), request.size(), 1, conn);
+	TEST_CHECK(responses.empty() && pending.size() == 1);
+
+	std::thread answer([] { pending.back()(2); pending.clear(); });
+	answer.join();
+	TEST_CHECK(responses.size() == 1);
+	const std::string answered = "[{\"code\":0,\"result\":2},{\"code\":0,\"result\":[";
+	TEST_CHECK(responses[0].compare(0, answered.size(), answered) == 0);
+	TEST_CHECK(responses[0].find("{\"code\":3,\"result\":\"__batch is not allowed in a batch\"}]") != std::string::npos);
+	r.remove_handler("test_later");
+	responses.clear();
+}
+
+TEST_CASE(router_frees_replaced_table)
+{
+	//a thread which has made a call and stays idle doesn't keep the table of that call.
+	auto marker = std::make_shared<int>(0);
+	std::weak_ptr<int> watch = marker;
+	router& r = router::get();
+	r.register_handler("test_marked", [marker] { return *marker; });
+	marker.reset();
+	r.set_callback([](const std::string&, std::string&& result, std::shared_ptr<connection>, std::uint32_t, bool)
+	{
+		string_pool::give_back(std::move(result));
+	});
+
+	boost::asio::io_service io_service;
+	buffer_pool pool;
+	auto conn = std::make_shared<connection>(io_service, pool, 0);
+	std::mutex mtx;
+	std::condition_variable cond;
+	bool called = false, checked = false;
+	std::thread caller([&]
+	{
+		const std::string request = "{\"test_marked\":\"\"}";
+		r.route(request.data(), request.size(), 1, conn);
+		std::unique_lock<std::mutex> lock(mtx);
+		called = true;
+		cond.notify_all();
+		cond.wait(lock, [&checked] { return checked; });
+	});
+
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		cond.wait(lock, [&called] { return called; });
+	}
+
+	TEST_CHECK(!watch.expired());
+	r.remove_handler("test_marked");
+	TEST_CHECK(watch.expired());
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		checked = true;
+	}
+
+	cond.notify_all();
+	caller.join();
+}
+
+TEST_CASE(router_refuses_priority_without_pool)
+{
+	router& r = router::get();
+	handler_options options;
+	options.exec = EXEC_INLINE;
+	options.priority = PRIORITY_HIGH;
+	bool refused = false;
+	try
+	{
+		r.register_handler("test_priority", [] { return 0; }, options);
+	}
+	catch (const std::invalid_argument&)
+	{
+		refused = true;
+	}
+
+	TEST_CHECK(refused);
+
+	held_calls held;
+	refused = false;
+	try
+	{
+		r.register_handler("test_priority", &held_calls::hold, &held, options);
+	}
+	catch (const std::invalid_argument&)
+	{
+		refused = true;
+	}
+
+	TEST_CHECK(refused);
+}
+
+TEST_CASE(router_singleflight_runs_overlapping_calls_once)
+{
+	static std::vector<async_response<int>> pending;
+	static std::vector<std::string> responses;
+	router& r = router::get();
+	handler_options options;
+	options.singleflight = true;
+	r.register_handler("test_flight", [](int, async_response<int> response)
+	{
+		pending.push_back(response);
+	}, options);
+	r.set_callback([](const std::string&, std::string&& result, std::shared_ptr<connection>, std::uint32_t, bool)
+	{
+		responses.push_back(std::move(result));
+	});
+
+	boost::asio::io_service io_service;
+	buffer_pool pool;
+	auto conn = std::make_shared<connection>(io_service, pool, 0);
+	//the same arguments with other white spaces are the same call.
+	const std::string request = "{\"test_flight\":[1]}";
+	const std::string same = "{\"test_flight\": [ 1 ]}";
+	r.route(request.data(), request.size(), 1, conn);
+	r.route(same.data(), same.size(), 2, conn);
+	TEST_CHECK(pending.size() == 1 && responses.empty());
+
+	pending.back()(2);
+	TEST_CHECK(responses.size() == 2 && responses[0] == responses[1]);
+
+	//the flight is over once it is answered, the next call runs the handler again.
+	r.route(request.data(), request.size(), 3, conn);
+	TEST_CHECK(pending.size() == 2);
+	pending.back()(2);
+	TEST_CHECK(responses.size() == 3);
+	r.remove_handler("test_flight");
+	pending.clear();
+	responses.clear();
+}
+
+//the shard of the result_cache which keeps the response of a request, the cache has 16 shards.
+static std::size_t cache_shard(const std::string& request)
+{
+	token_parser parser;
+	parser.parse(request.data(), request.size());
+	parser.get<std::string>();
+	std::string key;
+	json_codec::append_key(key, parser.raw_args());
+	return std::hash<std::string>()(key) % 16;
+}
+
+struct cached_calls
+{
+	cached_calls(const std::string& name, std::size_t ttl_ms, std::size_t capacity) : name(name), calls(0)
+	{
+		handler_options options;
+		options.cache_ttl_ms = ttl_ms;
+		options.cache_capacity = capacity;
+		router::get().register_handler(name, [this](int a) { ++calls; return a; }, options);
+		router::get().set_callback([](const std::string&, std::string&& result, std::shared_ptr<connection>, std::uint32_t, bool)
+		{
+			string_pool::give_back(std::move(result));
+		});
+	}
+
+	~cached_calls()
+	{
+		router::get().remove_handler(name);
+	}
+
+	std::string request(int a) const
+	{
+		return "{\"" + name + "\":[" + std::to_string(a) + "]}";
+	}
+
+	//the number of times the handler has run after the call.
+	int call(int a)
+	{
+		const std::string text = request(a);
+		router::get().route(text.data(), text.size(), 1, conn);
+		return calls;
+	}
+
+	std::string name;
+	int calls;
+	boost::asio::io_service io_service;
+	buffer_pool pool;
+	std::shared_ptr<connection> conn = std::make_shared<connection>(io_service, pool, 0);
+};
+
+TEST_CASE(router_cache_expires_after_ttl)
+{
+	cached_calls cached("test_ttl", 100, 1024);
+	TEST_CHECK(cached.call(1) == 1);
+	TEST_CHECK(cached.call(1) == 1);
+	TEST_CHECK(cached.call(2) == 2);
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(150));
+	TEST_CHECK(cached.call(1) == 3);
+	TEST_CHECK(cached.call(1) == 3);
+}
+
+TEST_CASE(router_cache_evicts_least_recently_used)
+{
+	//a capacity of 16 keeps 2 entries in each shard, so a third one in the shard of a and b evicts one of them.
+	cached_calls cached("test_lru", 60000, 16);
+	std::vector<int> same;
+	const std::size_t shard = cache_shard(cached.request(0));
+	for (int a = 0; same.size() < 3; a++)
+	{
+		if (cache_shard(cached.request(a)) == shard)
+			same.push_back(a);
+	}
+
+	TEST_CHECK(cached.call(same[0]) == 1);
+	TEST_CHECK(cached.call(same[1]) == 2);
+	//a hit makes same[0] the recent one, so same[1] is evicted.
+	TEST_CHECK(cached.call(same[0]) == 2);
+	TEST_CHECK(cached.call(same[2]) == 3);
+	TEST_CHECK(cached.call(same[0]) == 3);
+	TEST_CHECK(cached.call(same[2]) == 3);
+	TEST_CHECK(cached.call(same[1]) == 4);
+}
+
+int test_static_one() { return 1; }
+int test_static_add(int a, int b) { return a + b; }
+std::string test_static_echo(const std::string& s) { return s; }
+
+TEST_CASE(router_dispatches_static_handlers)
+{
+	typedef perfect_hash<hash_name("test_one", 8), hash_name("test_add", 8), hash_name("test_echo", 9)> hash_type;
+	static_assert(hash_type::distinct() && hash_type::is_perfect(hash_type::find_seed()), "no perfect hash for the test names");
+
+	static std::vector<std::string> responses;
+	router& r = router::get();
+	r.register_handlers(RPC_HANDLER("test_one", &test_static_one), RPC_HANDLER("test_add", &test_static_add),
+		RPC_HANDLER("test_echo", &test_static_echo));
+	r.set_callback([](const std::string&, std::string&& result, std::shared_ptr<connection>, std::uint32_t, bool)
+	{
+		responses.push_back(std::move(result));
+	});
+
+	boost::asio::io_service io_service;
+	buffer_pool pool;
+	auto conn = std::make_shared<connection>(io_service, pool, 0);
+	auto call = [&r, &conn](const std::string& request)
+	{
+		r.route(request.data(), request.size(), 1, conn);
+		return responses.back();
+	};
+
+	TEST_CHECK(call("{\"test_one\":\"\"}") == "{\"code\":0,\"result\":1}");
+	TEST_CHECK(call("{\"test_add\":[1,2]}") == "{\"code\":0,\"result\":3}");
+	TEST_CHECK(call("{\"test_echo\":[\"a\"]}") == "{\"code\":0,\"result\":\"a\"}");
+
+	//a name in the slot of a handler is compared with its name too.
+	const std::uint64_t seed = hash_type::find_seed();
+	const std::size_t taken = hash_type::slot(hash_name("test_add", 8), seed);
+	std::string other;
+	for (int i = 0; other.empty(); i++)
+	{
+		const std::string name = "test_" + std::to_string(i);
+		if (hash_type::slot(hash_name(name.data(), name.size()), seed) == taken)
+			other = name;
+	}
+
+	const std::string unknown = "{\"code\":3,\"result\":\"unknown function: ";
+	TEST_CHECK(call("{\"" + other + "\":[1,2]}").compare(0, unknown.size(), unknown) == 0);
+	TEST_CHECK(call("{\"test_none\":[]}").compare(0, unknown.size(), unknown) == 0);
+	responses.clear();
+}
@@ -1,105 +1,816 @@
 #pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <locale>
+#include <sstream>
+#include <string>
 #include <kapok/Kapok.hpp>
-class token_parser
+#include <boost/lexical_cast.hpp>
+#include <boost/utility/string_ref.hpp>
+#include "bin_codec.hpp"
+
+//reads json values straight into typed variables while scanning the text, no document is built.
+//strings point into the input unless they have escapes, values which are not wanted are skipped without allocating.
+//a type it doesn't know is handed to kapok as a json fragment.
+class json_reader
 {
 public:
-	void parse(const char* s, std::size_t length)
+	json_reader(const char* data, std::size_t length) : p_(data), end_(data + length), depth_(0)
+	{
+	}
+
+	//the next character which is not a white space, 0 at the end of input.
+	char peek()
+	{
+		while (p_ != end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r'))
+			++p_;
+
+		return p_ == end_ ? 0 : *p_;
+	}
+
+	bool try_take(char c)
+	{
+		if (peek() != c)
+			return false;
+
+		++p_;
+		return true;
+	}
+
+	//only white space may be left.
+	void expect_end()
+	{
+		peek();
+		if (p_ != end_)
+			throw std::invalid_argument("unexpected text after the end");
+	}
+
+	void expect(char c)
+	{
+		if (!try_take(c))
+			throw std::invalid_argument(std::string("'") + c + "' expected");
+	}
+
+	bool try_read_null()
 	{
-		v_.clear();
-		dr_.Parse(s, length);
-		Document& doc = dr_.GetDocument();
-		auto it = doc.MemberBegin();
-		v_.push_back(it->name.GetString());
+		if (peek() != 'n')
+			return false;
 
-		StringBuffer buf;
-		rapidjson::Writer<StringBuffer> wr(buf);
-		if (it->value.IsArray())
+		take_literal("null");
+		return true;
+	}
+
+	bool at_empty_str()
+	{
+		return peek() == '"' && end_ - p_ >= 2 && p_[1] == '"';
+	}
+
+	//the string points into the input, or into scratch if it has escapes.
+	void read_str(const char*& str, std::size_t& size, std::string& scratch)
+	{
+		expect('"');
+		const char* begin = p_;
+		while (p_ != end_ && *p_ != '"' && *p_ != '\\')
+			++p_;
+
+		if (p_ == end_)
+			throw std::invalid_argument("unterminated string");
+
+		if (*p_ == '"')
 		{
-			for (size_t i = 0; i < it->value.Size(); i++)
-			{
-				put_str(it->value[i], wr, buf);
-			}
+			str = begin;
+			size = p_++ - begin;
+			return;
+		}
+
+		scratch.assign(begin, p_);
+		for (;;)
+		{
+			if (p_ == end_)
+				throw std::invalid_argument("unterminated string");
+
+			char c = *p_++;
+			if (c == '"')
+				break;
+
+			if (c == '\\')
+				unescape(scratch);
+			else
+				scratch.push_back(c);
+		}
+
+		str = scratch.data();
+		size = scratch.size();
+	}
+
+	void read(std::string& str)
+	{
+		if (peek() != '"')
+		{
+			//a value which is not a string is taken as its json text.
+			const char* begin = p_;
+			skip();
+			str.assign(begin, p_);
+			return;
+		}
+
+		const char* p;
+		std::size_t size;
+		read_str(p, size, str);
+		if (p != str.data())
+			str.assign(p, size);
+	}
+
+	void read(bool& b)
+	{
+		char c = peek();
+		if (c == 't' || c == 'f')
+		{
+			b = c == 't';
+			take_literal(b ? "true" : "false");
+		}
+		else if (c == '"')
+		{
+			b = boost::lexical_cast<bool>(read_string());
 		}
 		else
 		{
-			put_str(it->value, wr, buf);
+			double v;
+			read_float(v);
+			b = v != 0;
 		}
 	}
 
-	template<typename RequestedType>
-	typename std::decay<RequestedType>::type get()
+	template<typename T>
+	void read(T& t)
 	{
-		if (v_.empty())
-			throw std::invalid_argument("unexpected end of input");
+		read_value(t, kind<T>());
+	}
 
-		try
+	//the text which is not read yet.
+	boost::string_ref rest() const
+	{
+		return boost::string_ref(p_, end_ - p_);
+	}
+
+	//the json text of the next value.
+	boost::string_ref read_raw()
+	{
+		peek();
+		const char* begin = p_;
+		skip();
+		return boost::string_ref(begin, p_ - begin);
+	}
+
+	//skip a value of any type.
+	void skip()
+	{
+		char c = peek();
+		if (c == '"')
+		{
+			skip_str();
+		}
+		else if (c == '{' || c == '[')
 		{
-			typedef typename std::decay<RequestedType>::type result_type;
+			if (++depth_ > MAX_DEPTH)
+				throw std::invalid_argument("nesting is too deep");
+
+			++p_;
+			const char close = c == '{' ? '}' : ']';
+			if (!try_take(close))
+			{
+				do
+				{
+					if (c == '{')
+					{
+						skip_str();
+						expect(':');
+					}
 
-			auto it = v_.begin();
-			result_type result = lexical_cast<typename std::decay<result_type>::type>(*it);
-			v_.erase(it);
-			return result;
+					skip();
+				} while (try_take(','));
+
+				expect(close);
+			}
+
+			--depth_;
 		}
-		catch (std::exception& e)
+		else if (c == 't' || c == 'f' || c == 'n')
 		{
-			v_.clear();
-			throw std::invalid_argument(std::string("invalid argument: ") + e.what());
+			take_literal(c == 't' ? "true" : c == 'f' ? "false" : "null");
+		}
+		else
+		{
+			number_span();
 		}
 	}
 
-	bool empty() const { return v_.empty(); }
+private:
+	enum { MAX_DEPTH = 256 };
+	template<int N> struct kind_tag {};
+	enum { INTEGER_KIND, FLOAT_KIND, ENUM_KIND, META_KIND, MAP_KIND, SEQUENCE_KIND, TUPLE_KIND, OTHER_KIND };
 
-	std::size_t param_size()
+	template<typename T>
+	static auto kind()
 	{
-		return v_.size();
+		return kind_tag<std::is_enum<T>::value ? ENUM_KIND : std::is_floating_point<T>::value ? FLOAT_KIND : std::is_integral<T>::value ? INTEGER_KIND :
+			bin_has_meta<T>::value ? META_KIND : bin_is_map<T>::value ? MAP_KIND : bin_is_sequence<T>::value ? SEQUENCE_KIND :
+			bin_is_tuple<T>::value ? TUPLE_KIND : OTHER_KIND>();
 	}
 
-	token_parser() = default;
-private:
-	
-	token_parser(const token_parser&) = delete;
-	token_parser(token_parser&&) = delete;
+	template<typename T>
+	void read_value(T& t, kind_tag<INTEGER_KIND>)
+	{
+		if (peek() == '"')
+		{
+			t = boost::lexical_cast<T>(read_string());
+			return;
+		}
+
+		const bool negative = try_take('-');
+		if (p_ == end_ || *p_ < '0' || *p_ > '9')
+			throw std::invalid_argument("integer expected");
+
+		if (*p_ == '0' && end_ - p_ > 1 && p_[1] >= '0' && p_[1] <= '9')
+			throw std::invalid_argument("leading zeros");
+
+		std::uint64_t v = 0;
+		while (p_ != end_ && *p_ >= '0' && *p_ <= '9')
+		{
+			const unsigned d = *p_++ - '0';
+			if (v > (std::numeric_limits<std::uint64_t>::max() - d) / 10)
+				throw std::out_of_range("integer out of range");
+
+			v = v * 10 + d;
+		}
+
+		if (p_ != end_ && (*p_ == '.' || *p_ == 'e' || *p_ == 'E'))
+			throw std::invalid_argument("integer expected");
+
+		const std::uint64_t max = static_cast<std::uint64_t>(std::numeric_limits<T>::max());
+		if (v > (negative ? (std::is_signed<T>::value ? max + 1 : 0) : max))
+			throw std::out_of_range("integer out of range");
+
+		t = static_cast<T>(negative ? 0 - v : v);
+	}
 
 	template<typename T>
-	typename std::enable_if<is_basic_type<T>::value, T>::type lexical_cast(const std::string& str)
+	void read_value(T& t, kind_tag<FLOAT_KIND>)
 	{
-		return boost::lexical_cast<T>(str);
+		double v;
+		read_float(v);
+		t = static_cast<T>(v);
 	}
 
 	template<typename T>
-	typename std::enable_if<!is_basic_type<T>::value, T>::type lexical_cast(const std::string& str)
+	void read_value(T& t, kind_tag<ENUM_KIND>)
 	{
-		dr_.Parse(str);
-		T t;
-		dr_.Deserialize<T>(t, false);
-		return t;
+		typename std::underlying_type<T>::type v;
+		read(v);
+		t = static_cast<T>(v);
 	}
 
-	void put_str(Value& val, rapidjson::Writer<StringBuffer>& wr, StringBuffer& buf)
+	//the fields are matched by name, fields of the json which the struct doesn't have are skipped.
+	template<typename T>
+	void read_value(T& t, kind_tag<META_KIND>)
 	{
-		if (val.IsString())
+		auto meta = t.Meta();
+		expect('{');
+		if (try_take('}'))
+			return;
+
+		do
 		{
-			v_.push_back(val.GetString());
+			const char* key;
+			std::size_t size;
+			read_str(key, size, scratch_);
+			expect(':');
+			if (!read_field(meta, key, size, std::make_index_sequence<std::tuple_size<decltype(meta)>::value>{}))
+				skip();
+		} while (try_take(','));
+
+		expect('}');
+	}
+
+	template<typename T>
+	void read_value(T& t, kind_tag<MAP_KIND>)
+	{
+		t.clear();
+		expect('{');
+		if (try_take('}'))
 			return;
-		}
 
-		val.Accept(wr);
-		const char* js = buf.GetString();
-		const int len = strlen(js);
-		if (len == 0)
+		do
+		{
+			typename std::decay<typename T::key_type>::type key;
+			read_key(key);
+			expect(':');
+			typename T::mapped_type value;
+			read(value);
+			t.emplace(std::move(key), std::move(value));
+		} while (try_take(','));
+
+		expect('}');
+	}
+
+	template<typename T>
+	void read_value(T& t, kind_tag<SEQUENCE_KIND>)
+	{
+		t.clear();
+		expect('[');
+		if (try_take(']'))
 			return;
 
-		if (len == 2 && js[0] == '"')
+		do
+		{
+			typename T::value_type value;
+			read(value);
+			t.insert(t.end(), std::move(value));
+		} while (try_take(','));
+
+		expect(']');
+	}
+
+	template<typename T>
+	void read_value(T& t, kind_tag<TUPLE_KIND>)
+	{
+		expect('[');
+		read_elements(t, std::make_index_sequence<std::tuple_size<T>::value>{});
+		expect(']');
+	}
+
+	template<typename T>
+	void read_value(T& t, kind_tag<OTHER_KIND>)
+	{
+		peek();
+		const char* begin = p_;
+		skip();
+		DeSerializer dr;
+		dr.Parse(begin, p_ - begin);
+		dr.Deserialize(t, false);
+	}
+
+	template<typename Tuple, std::size_t... I>
+	bool read_field(Tuple& meta, const char* key, std::size_t size, std::index_sequence<I...>)
+	{
+		bool found = false;
+		(void)std::initializer_list<int>{ (!found && key_equal(std::get<I>(meta).first, key, size) ?
+			(read(bin_unwrap(std::get<I>(meta).second)), found = true, 0) : 0)... };
+		return found;
+	}
+
+	template<typename Tuple, std::size_t... I>
+	void read_elements(Tuple& t, std::index_sequence<I...>)
+	{
+		(void)std::initializer_list<int>{ ((I == 0 ? void() : expect(',')), read(std::get<I>(t)), 0)... };
+	}
+
+	static bool key_equal(const char* name, const char* key, std::size_t size)
+	{
+		return strlen(name) == size && memcmp(name, key, size) == 0;
+	}
+
+	void read_key(std::string& key)
+	{
+		const char* p;
+		std::size_t size;
+		read_str(p, size, key);
+		if (p != key.data())
+			key.assign(p, size);
+	}
+
+	template<typename T>
+	void read_key(T& key)
+	{
+		key = boost::lexical_cast<T>(read_string());
+	}
+
+	std::string read_string()
+	{
+		std::string str;
+		read_key(str);
+		return str;
+	}
+
+	void read_float(double& v)
+	{
+		if (peek() == '"')
+		{
+			v = boost::lexical_cast<double>(read_string());
 			return;
+		}
+
+		const char* begin = p_;
+		number_span();
+		v = to_double(begin, p_);
+	}
+
+	//up to 19 digits and a power of ten up to 22 are exact doubles, so their product or quotient is rounded
+	//once and is exact. other numbers are read by a stream in the classic locale, unlike strtod it doesn't take
+	//the decimal point of the locale.
+	static double to_double(const char* begin, const char* end)
+	{
+		const char* p = begin;
+		const bool negative = *p == '-';
+		if (negative)
+			++p;
+
+		std::uint64_t m = 0;
+		int digits = 0, exp = 0;
+		bool fraction = false;
+		for (; p != end && *p != 'e' && *p != 'E'; ++p)
+		{
+			if (*p == '.')
+			{
+				fraction = true;
+				continue;
+			}
+
+			if ((m != 0 || *p != '0') && ++digits > 19)
+				return to_double_slow(begin, end);
+
+			m = m * 10 + (*p - '0');
+			if (fraction)
+				--exp;
+		}
 
-		v_.push_back(js);
+		if (p != end)
+		{
+			++p;
+			const bool negative_exp = *p == '-';
+			if (*p == '-' || *p == '+')
+				++p;
+
+			int e = 0;
+			for (; p != end && e < 10000; ++p)
+				e = e * 10 + (*p - '0');
+
+			exp += negative_exp ? -e : e;
+		}
+
+		static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+		if (m > (std::uint64_t(1) << 53) || exp < -22 || exp > 22)
+			return to_double_slow(begin, end);
+
+		const double v = exp < 0 ? static_cast<double>(m) / powers[-exp] : static_cast<double>(m) * powers[exp];
+		return negative ? -v : v;
+	}
+
+	static double to_double_slow(const char* begin, const char* end)
+	{
+		std::istringstream is(std::string(begin, end));
+		is.imbue(std::locale::classic());
+		double v;
+		if (!(is >> v))
+			throw std::out_of_range("number out of range");
+
+		return v;
+	}
+
+	//-?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+	void number_span()
+	{
+		if (p_ != end_ && *p_ == '-')
+			++p_;
+
+		if (p_ == end_ || *p_ < '0' || *p_ > '9')
+			throw std::invalid_argument("unexpected character");
+
+		if (*p_++ == '0' && p_ != end_ && *p_ >= '0' && *p_ <= '9')
+			throw std::invalid_argument("leading zeros");
+
+		skip_digits();
+		if (p_ != end_ && *p_ == '.')
+		{
+			++p_;
+			if (!skip_digits())
+				throw std::invalid_argument("digit expected");
+		}
+
+		if (p_ != end_ && (*p_ == 'e' || *p_ == 'E'))
+		{
+			++p_;
+			if (p_ != end_ && (*p_ == '+' || *p_ == '-'))
+				++p_;
+
+			if (!skip_digits())
+				throw std::invalid_argument("digit expected");
+		}
+	}
+
+	//false if there is no digit.
+	bool skip_digits()
+	{
+		const char* begin = p_;
+		while (p_ != end_ && *p_ >= '0' && *p_ <= '9')
+			++p_;
+
+		return p_ != begin;
+	}
+
+	void skip_str()
+	{
+		expect('"');
+		for (;;)
+		{
+			if (p_ == end_)
+				throw std::invalid_argument("unterminated string");
+
+			const char c = *p_++;
+			if (c == '"')
+				break;
+
+			if (c == '\\')
+				skip_escape();
+		}
+	}
+
+	//checks the escape after a backslash without decoding it.
+	void skip_escape()
+	{
+		if (p_ == end_)
+			throw std::invalid_argument("unterminated string");
+
+		const char c = *p_++;
+		if (c == 'u')
+			take_code_point();
+		else if (c != '"' && c != '\\' && c != '/' && c != 'b' && c != 'f' && c != 'n' && c != 'r' && c != 't')
+			throw std::invalid_argument("invalid escape");
+	}
+
+	void take_literal(const char* literal)
+	{
+		const std::size_t size = strlen(literal);
+		if (static_cast<std::size_t>(end_ - p_) < size || memcmp(p_, literal, size) != 0)
+			throw std::invalid_argument("unexpected character");
+
+		p_ += size;
+	}
+
+	void unescape(std::string& out)
+	{
+		if (p_ == end_)
+			throw std::invalid_argument("unterminated string");
+
+		switch (char c = *p_++)
+		{
+		case 'b': out.push_back('\b'); break;
+		case 'f': out.push_back('\f'); break;
+		case 'n': out.push_back('\n'); break;
+		case 'r': out.push_back('\r'); break;
+		case 't': out.push_back('\t'); break;
+		case 'u': append_utf8(out, take_code_point()); break;
+		case '"': case '\\': case '/': out.push_back(c); break;
+		default: throw std::invalid_argument("invalid escape");
+		}
+	}
+
+	unsigned take_code_point()
+	{
+		unsigned cp = take_hex4();
+		if (cp >= 0xd800 && cp <= 0xdbff)
+		{
+			take_literal("\\u");
+			unsigned low = take_hex4();
+			if (low < 0xdc00 || low > 0xdfff)
+				throw std::invalid_argument("invalid surrogate pair");
 
-		wr.Reset(buf);
-		buf.Clear();
+			cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+		}
+
+		return cp;
 	}
 
-	DeSerializer dr_;
-	std::vector<std::string> v_;
+	unsigned take_hex4()
+	{
+		if (end_ - p_ < 4)
+			throw std::invalid_argument("unterminated string");
+
+		unsigned v = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			char c = *p_++;
+			v <<= 4;
+			if (c >= '0' && c <= '9')
+				v |= c - '0';
+			else if (c >= 'a' && c <= 'f')
+				v |= c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F')
+				v |= c - 'A' + 10;
+			else
+				throw std::invalid_argument("invalid escape");
+		}
+
+		return v;
+	}
+
+	static void append_utf8(std::string& out, unsigned cp)
+	{
+		if (cp < 0x80)
+		{
+			out.push_back(static_cast<char>(cp));
+		}
+		else if (cp < 0x800)
+		{
+			out.push_back(static_cast<char>(0xc0 | (cp >> 6)));
+			out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+		}
+		else if (cp < 0x10000)
+		{
+			out.push_back(static_cast<char>(0xe0 | (cp >> 12)));
+			out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+			out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+		}
+		else
+		{
+			out.push_back(static_cast<char>(0xf0 | (cp >> 18)));
+			out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+			out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+			out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+		}
+	}
+
+	const char* p_;
+	const char* end_;
+	std::size_t depth_;
+	std::string scratch_;
 };
 
+//a request is an object with one member: the handler name and the arguments, the first token is the handler name.
+//the arguments are decoded from the text when they are read, an array holds them, other values are the only argument.
+//the client sends "" for a call without arguments, so an empty string is no argument unless a handler reads it.
+class token_parser
+{
+public:
+	token_parser() : reader_(nullptr, 0), name_(nullptr), name_size_(0), name_taken_(true), in_array_(false), done_(true), empty_str_(false)
+	{
+	}
+
+	void parse(const char* s, std::size_t length)
+	{
+		reader_ = json_reader(s, length);
+		reader_.expect('{');
+		reader_.read_str(name_, name_size_, name_scratch_);
+		reader_.expect(':');
+		name_taken_ = false;
+
+		const char c = reader_.peek();
+		in_array_ = c == '[';
+		empty_str_ = false;
+		if (in_array_)
+		{
+			reader_.expect('[');
+			done_ = reader_.try_take(']');
+		}
+		else
+		{
+			done_ = reader_.try_read_null();
+			empty_str_ = !done_ && reader_.at_empty_str();
+		}
+
+		if (done_)
+		{
+			finish();
+		}
+		else if (empty_str_)
+		{
+			json_reader rest = reader_;
+			rest.skip();
+			rest.expect('}');
+			rest.expect_end();
+		}
+	}
+
+	template<typename RequestedType>
+	typename std::decay<RequestedType>::type get()
+	{
+		typename std::decay<RequestedType>::type result;
+		read(result);
+		return result;
+	}
+
+	template<typename T>
+	void read(T& t)
+	{
+		if (!name_taken_)
+		{
+			name_taken_ = true;
+			take_name(t);
+			return;
+		}
+
+		if (done_)
+			throw std::invalid_argument("parameter number is not match");
+
+		try
+		{
+			reader_.read(t);
+		}
+		catch (std::invalid_argument& e)
+		{
+			throw std::invalid_argument(std::string("invalid argument: ") + e.what());
+		}
+		catch (std::out_of_range& e)
+		{
+			throw std::invalid_argument(std::string("invalid argument: ") + e.what());
+		}
+
+		empty_str_ = false;
+		done_ = !in_array_ || !reader_.try_take(',');
+		if (done_ && in_array_)
+			reader_.expect(']');
+
+		if (done_)
+			finish();
+	}
+
+	//the handler name without a copy, it lives as long as the request.
+	boost::string_ref read_name()
+	{
+		if (name_taken_)
+			throw std::invalid_argument("the handler name is taken");
+
+		name_taken_ = true;
+		return boost::string_ref(name_, name_size_);
+	}
+
+	//the next argument as json text, e.g. a call of a batch.
+	boost::string_ref read_raw()
+	{
+		if (!name_taken_ || done_)
+			throw std::invalid_argument("parameter number is not match");
+
+		boost::string_ref raw = reader_.read_raw();
+		empty_str_ = false;
+		done_ = !in_array_ || !reader_.try_take(',');
+		if (done_ && in_array_)
+			reader_.expect(']');
+
+		if (done_)
+			finish();
+
+		return raw;
+	}
+
+	//the text of the arguments left, with the end of the request.
+	boost::string_ref raw_args() const
+	{
+		return done_ ? boost::string_ref() : reader_.rest();
+	}
+
+	bool empty() const { return name_taken_ && (done_ || empty_str_); }
+
+	//counts the arguments left by skipping over them, the router doesn't need it.
+	std::size_t param_size()
+	{
+		std::size_t size = name_taken_ ? 0 : 1;
+		if (done_)
+			return size;
+
+		if (!in_array_)
+			return size + 1;
+
+		json_reader reader = reader_;
+		do
+		{
+			reader.skip();
+			++size;
+		} while (reader.try_take(','));
+
+		return size;
+	}
+
+private:
+	token_parser(const token_parser&) = delete;
+	token_parser(token_parser&&) = delete;
+
+	void take_name(std::string& name)
+	{
+		name.assign(name_, name_size_);
+	}
+
+	template<typename T>
+	void take_name(T&)
+	{
+		throw std::invalid_argument("the handler name is a string");
+	}
+
+	//the arguments are read, the request ends after them.
+	void finish()
+	{
+		reader_.expect('}');
+		reader_.expect_end();
+	}
+
+	json_reader reader_;
+	const char* name_;
+	std::size_t name_size_;
+	std::string name_scratch_;
+	bool name_taken_;
+	bool in_array_;
+	bool done_;
+	bool empty_str_; //the only argument is "", which a handler without parameters doesn't read
+};
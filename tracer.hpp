@@ -0,0 +1,229 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <ostream>
+#include <fstream>
+
+//sampled tracing of the stages of requests. a sampled request gets a trace id, the stages which run on a thread while
+//the id is the current trace of the thread are recorded in a ring buffer of the thread. the rings keep the latest events
+//and are written as a chrome trace_event json file, which chrome://tracing or ui.perfetto.dev show as a timeline.
+class tracer
+{
+public:
+	enum { RING_SIZE = 16384 };
+
+	static tracer& get()
+	{
+		static tracer instance;
+		return instance;
+	}
+
+	//traces one in every sample_every requests of a thread, 0 turns tracing off.
+	void set_sample_every(std::size_t sample_every)
+	{
+		sample_every_.store(sample_every, std::memory_order_relaxed);
+	}
+
+	bool enabled() const
+	{
+		return sample_every_.load(std::memory_order_relaxed) != 0;
+	}
+
+	//the trace id of a new request, 0 if it is not sampled.
+	std::uint64_t sample()
+	{
+		const std::size_t every = sample_every_.load(std::memory_order_relaxed);
+		if (every == 0)
+			return 0;
+
+		static thread_local std::size_t count = 0;
+		if (++count % every != 0)
+			return 0;
+
+		return next_id_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	//microseconds of the steady clock.
+	static std::uint64_t micros(std::chrono::steady_clock::time_point t)
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+	}
+
+	static std::uint64_t now()
+	{
+		return micros(std::chrono::steady_clock::now());
+	}
+
+	//the trace of the request the thread works on, 0 if it is not traced.
+	static std::uint64_t& current()
+	{
+		static thread_local std::uint64_t trace = 0;
+		return trace;
+	}
+
+	//the name is a string literal, it is kept as a pointer.
+	void record(const char* name, std::uint64_t trace, std::uint64_t start, std::uint64_t end)
+	{
+		ring& r = local_ring();
+		const std::uint64_t head = r.head.load(std::memory_order_relaxed);
+		slot& s = r.slots[head % RING_SIZE];
+		s.name.store(name, std::memory_order_relaxed);
+		s.trace.store(trace, std::memory_order_relaxed);
+		s.ts.store(start, std::memory_order_relaxed);
+		s.dur.store(end - start, std::memory_order_relaxed);
+		r.head.store(head + 1, std::memory_order_release);
+	}
+
+	//{"traceEvents":[...]} with a complete event for each stage, the trace id is in its args.
+	void write(std::ostream& os)
+	{
+		std::vector<event> events;
+		bool first = true;
+		os << "{\"traceEvents\":[";
+		std::unique_lock<std::mutex> lock(mtx_);
+		for (auto& r : rings_)
+		{
+			events.clear();
+			snapshot(*r, events);
+			for (auto& e : events)
+			{
+				os << (first ? "" : ",\n") << "{\"name\":\"" << e.name << "\",\"cat\":\"rpc\",\"ph\":\"X\",\"ts\":" << e.ts << ",\"dur\":" << e.dur
+					<< ",\"pid\":1,\"tid\":" << r->tid << ",\"args\":{\"trace\":" << e.trace << "}}";
+				first = false;
+			}
+		}
+
+		os << "]}\n";
+	}
+
+	bool write_file(const std::string& path)
+	{
+		std::ofstream file(path.c_str(), std::ios::out | std::ios::trunc);
+		if (!file)
+			return false;
+
+		write(file);
+		return static_cast<bool>(file);
+	}
+
+private:
+	tracer() : sample_every_(0), next_id_(1)
+	{
+	}
+
+	struct event
+	{
+		const char* name;
+		std::uint64_t trace;
+		std::uint64_t ts;
+		std::uint64_t dur;
+	};
+
+	//the fields are atomic because the thread may overwrite a slot while it is copied.
+	struct slot
+	{
+		std::atomic<const char*> name;
+		std::atomic<std::uint64_t> trace;
+		std::atomic<std::uint64_t> ts;
+		std::atomic<std::uint64_t> dur;
+	};
+
+	//written only by its thread, so recording takes no lock. a ring outlives its thread and keeps its events.
+	struct ring
+	{
+		explicit ring(std::size_t tid) : head(0), tid(tid), slots(RING_SIZE)
+		{
+		}
+
+		std::atomic<std::uint64_t> head;
+		std::size_t tid;
+		std::vector<slot> slots;
+	};
+
+	ring& local_ring()
+	{
+		static thread_local ring* r = nullptr;
+		if (r == nullptr)
+		{
+			std::unique_lock<std::mutex> lock(mtx_);
+			rings_.emplace_back(new ring(rings_.size() + 1));
+			r = rings_.back().get();
+		}
+
+		return *r;
+	}
+
+	//copies the events while the thread may go on recording, the ones it may have overwritten meanwhile are dropped.
+	//a slot is written before head is moved past it, so the slot of new_head may be half written too.
+	static void snapshot(const ring& r, std::vector<event>& events)
+	{
+		const std::uint64_t head = r.head.load(std::memory_order_acquire);
+		const std::uint64_t begin = head > RING_SIZE ? head - RING_SIZE : 0;
+		for (std::uint64_t i = begin; i < head; i++)
+		{
+			const slot& s = r.slots[i % RING_SIZE];
+			events.push_back({ s.name.load(std::memory_order_relaxed), s.trace.load(std::memory_order_relaxed),
+				s.ts.load(std::memory_order_relaxed), s.dur.load(std::memory_order_relaxed) });
+		}
+
+		const std::uint64_t new_head = r.head.load(std::memory_order_acquire);
+		const std::uint64_t overwritten = new_head + 1 > RING_SIZE ? new_head + 1 - RING_SIZE : 0;
+		if (overwritten > begin)
+			events.erase(events.begin(), events.begin() + static_cast<std::size_t>(std::min(overwritten, head) - begin));
+	}
+
+	std::atomic<std::size_t> sample_every_;
+	std::atomic<std::uint64_t> next_id_;
+	std::mutex mtx_;
+	std::vector<std::unique_ptr<ring>> rings_;
+};
+
+//records the time from its construction to its destruction as a stage of the current trace of the thread.
+class trace_span
+{
+public:
+	explicit trace_span(const char* name) : name_(name), trace_(tracer::current()), start_(trace_ != 0 ? tracer::now() : 0)
+	{
+	}
+
+	~trace_span()
+	{
+		if (trace_ != 0)
+			tracer::get().record(name_, trace_, start_, tracer::now());
+	}
+
+private:
+	trace_span(const trace_span&) = delete;
+	trace_span& operator=(const trace_span&) = delete;
+
+	const char* name_;
+	std::uint64_t trace_;
+	std::uint64_t start_;
+};
+
+//makes a trace the current one of the thread while it lives.
+class trace_scope
+{
+public:
+	explicit trace_scope(std::uint64_t trace) : saved_(tracer::current())
+	{
+		tracer::current() = trace;
+	}
+
+	~trace_scope()
+	{
+		tracer::current() = saved_;
+	}
+
+private:
+	trace_scope(const trace_scope&) = delete;
+	trace_scope& operator=(const trace_scope&) = delete;
+
+	std::uint64_t saved_;
+};
@@ -3,6 +3,8 @@
 #include <chrono>
 #include <thread>
 #include "common.h"
+#include "bin_codec.hpp"
+#include "json_writer.hpp"
 #include <kapok/Kapok.hpp>
 
 static bool retry(const std::function<bool()>& func, size_t max_attempts, size_t retry_interval = 0) 
@@ -19,13 +21,39 @@ static bool retry(const std::function<bool()>& func, size_t max_attempts, size_t
 	return false;
 }
 
+//the response_msg envelope is appended to buf field by field, the result is not copied into a response_msg first.
+template<typename T>
+static void get_json(std::string& buf, result_code code, const T& r)
+{
+	json_writer wr(buf);
+	wr.write_raw("{\"code\":", 8);
+	wr.write(static_cast<int>(code));
+	wr.write_raw(",\"result\":", 10);
+	wr.write(r);
+	wr.write_raw("}", 1);
+}
+
 template<typename T>
 static std::string get_json(result_code code, const T& r)
 {
-	response_msg<T> msg = { code, r };
+	std::string buf;
+	get_json(buf, code, r);
+	return buf;
+}
 
-	Serializer sr;
-	sr.Serialize(msg);
-	return sr.GetString();
+template<typename T>
+static void get_bin(std::string& buf, result_code code, const T& r)
+{
+	bin_writer wr(buf);
+	wr.write_array_head(2);
+	wr.write(static_cast<int>(code));
+	wr.write(r);
 }
 
+template<typename T>
+static std::string get_bin(result_code code, const T& r)
+{
+	std::string buf;
+	get_bin(buf, code, r);
+	return buf;
+}
@@ -0,0 +1,237 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <boost/noncopyable.hpp>
+
+//the tasks of a higher priority are run first, but a lower priority still gets some turns so it is not starved.
+enum task_priority
+{
+	PRIORITY_HIGH = 0,
+	PRIORITY_NORMAL = 1,
+	PRIORITY_LOW = 2,
+	PRIORITY_NUM = 3
+};
+
+//threads which run the handlers registered with EXEC_POOL, so they don't hold an io thread.
+//every thread has two deques: a task submitted by a worker goes to the back of its local deque and the worker takes
+//it from the back, the tasks of the io threads are spread over the injected deques and taken from the front, so the
+//requests are run in the order they came and the oldest one can't starve under load. an idle worker steals from the
+//front of the others, so the calls of a few busy connections spread over all the threads.
+//every priority has its own deques, out of 13 turns a worker prefers the high tasks 8 times, the normal ones 4 times
+//and the low ones once, and takes from the other priorities when the preferred one is empty.
+//the pool is bounded: when max_queued tasks of a priority are waiting a task of that priority is refused and the caller
+//answers that the server is busy, so a flood of low tasks doesn't refuse the high ones.
+class worker_pool : private boost::noncopyable
+{
+public:
+	worker_pool(std::size_t thread_num, std::size_t max_queued) : max_queued_(max_queued), total_(0), sleeping_(0), next_(0), stop_(false)
+	{
+		if (thread_num == 0)
+			thread_num = 1;
+
+		for (auto& n : queued_)
+			n = 0;
+
+		for (std::size_t i = 0; i < thread_num; ++i)
+			queues_.emplace_back(new task_queue);
+
+		for (std::size_t i = 0; i < thread_num; ++i)
+			threads_.emplace_back([this, i] { run(i); });
+	}
+
+	~worker_pool()
+	{
+		stop();
+	}
+
+	bool submit(std::function<void()>&& task, task_priority priority = PRIORITY_NORMAL)
+	{
+		if (stop_.load(std::memory_order_relaxed))
+			return false;
+
+		if (queued_[priority].fetch_add(1) >= static_cast<std::int64_t>(max_queued_))
+		{
+			queued_[priority].fetch_sub(1);
+			return false;
+		}
+
+		total_.fetch_add(1);
+
+		worker& self = current();
+		const bool local = self.pool == this;
+		std::size_t index = local ? self.index : next_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+		{
+			task_queue& q = *queues_[index];
+			std::unique_lock<std::mutex> lock(q.mtx);
+			(local ? q.local : q.injected)[priority].push_back(std::move(task));
+		}
+
+		//pairs with the check of total_ in run, a worker is either woken here or sees the task before it sleeps.
+		if (sleeping_.load() > 0)
+		{
+			std::unique_lock<std::mutex> lock(sleep_mtx_);
+			cv_.notify_one();
+		}
+
+		return true;
+	}
+
+	//the queued tasks are run before the threads exit.
+	void stop()
+	{
+		{
+			std::unique_lock<std::mutex> lock(sleep_mtx_);
+			if (stop_)
+				return;
+
+			stop_ = true;
+		}
+
+		cv_.notify_all();
+		for (auto& t : threads_)
+			t.join();
+	}
+
+private:
+	struct task_queue
+	{
+		std::mutex mtx;
+		std::deque<std::function<void()>> local[PRIORITY_NUM];
+		std::deque<std::function<void()>> injected[PRIORITY_NUM];
+	};
+
+	//the pool and the deque of the calling thread, if it is a worker.
+	struct worker
+	{
+		const worker_pool* pool;
+		std::size_t index;
+	};
+
+	static worker& current()
+	{
+		static thread_local worker w = { nullptr, 0 };
+		return w;
+	}
+
+	void run(std::size_t index)
+	{
+		current() = { this, index };
+		std::function<void()> task;
+		std::size_t turn = 0;
+		for (;;)
+		{
+			//a turn is used up only by a task, so the weights hold however often the queues are empty.
+			if (take(index, preferred(turn), task))
+			{
+				++turn;
+				total_.fetch_sub(1);
+				task();
+				task = nullptr;
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(sleep_mtx_);
+			++sleeping_;
+			cv_.wait(lock, [this] { return stop_ || total_.load() > 0; });
+			--sleeping_;
+			if (stop_ && total_.load() == 0)
+				return;
+		}
+	}
+
+	enum { HIGH_TURNS = 8, NORMAL_TURNS = 4, LOW_TURNS = 1 };
+
+	static task_priority preferred(std::size_t turn)
+	{
+		turn %= HIGH_TURNS + NORMAL_TURNS + LOW_TURNS;
+		return turn < HIGH_TURNS ? PRIORITY_HIGH : turn < HIGH_TURNS + NORMAL_TURNS ? PRIORITY_NORMAL : PRIORITY_LOW;
+	}
+
+	//the preferred priority first, then the others from the highest.
+	bool take(std::size_t index, task_priority preferred, std::function<void()>& task)
+	{
+		if (take_priority(index, preferred, task))
+			return true;
+
+		for (int p = PRIORITY_HIGH; p < PRIORITY_NUM; ++p)
+		{
+			if (p != preferred && take_priority(index, static_cast<task_priority>(p), task))
+				return true;
+		}
+
+		return false;
+	}
+
+	bool take_priority(std::size_t index, task_priority priority, std::function<void()>& task)
+	{
+		if (queued_[priority].load(std::memory_order_relaxed) <= 0)
+			return false;
+
+		if (pop(index, priority, task) || steal(index, priority, task))
+		{
+			queued_[priority].fetch_sub(1);
+			return true;
+		}
+
+		return false;
+	}
+
+	//the newest task this worker submitted, else the oldest one submitted from outside.
+	bool pop(std::size_t index, task_priority priority, std::function<void()>& task)
+	{
+		task_queue& q = *queues_[index];
+		std::unique_lock<std::mutex> lock(q.mtx);
+		auto& local = q.local[priority];
+		if (!local.empty())
+		{
+			task = std::move(local.back());
+			local.pop_back();
+			return true;
+		}
+
+		return take_front(q.injected[priority], task);
+	}
+
+	//takes the oldest task of another worker, the victims are tried in turn starting after this worker.
+	bool steal(std::size_t index, task_priority priority, std::function<void()>& task)
+	{
+		for (std::size_t i = 1; i < queues_.size(); ++i)
+		{
+			task_queue& q = *queues_[(index + i) % queues_.size()];
+			std::unique_lock<std::mutex> lock(q.mtx, std::try_to_lock);
+			if (lock.owns_lock() && (take_front(q.injected[priority], task) || take_front(q.local[priority], task)))
+				return true;
+		}
+
+		return false;
+	}
+
+	static bool take_front(std::deque<std::function<void()>>& tasks, std::function<void()>& task)
+	{
+		if (tasks.empty())
+			return false;
+
+		task = std::move(tasks.front());
+		tasks.pop_front();
+		return true;
+	}
+
+	std::vector<std::unique_ptr<task_queue>> queues_;
+	std::vector<std::thread> threads_;
+	std::size_t max_queued_;
+	std::atomic<std::int64_t> queued_[PRIORITY_NUM];
+	std::atomic<std::int64_t> total_;
+	std::atomic<std::size_t> sleeping_;
+	std::atomic<std::size_t> next_;
+	std::mutex sleep_mtx_;
+	std::condition_variable cv_;
+	std::atomic<bool> stop_;
+};